@@ -0,0 +1,309 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2017, Joyent Inc
+ * Author: Alex Wilson <alex.wilson@joyent.com>
+ */
+
+/*
+ * Quick benchmark for the soft-token agent's request handling.
+ *
+ * Sends a number of SSH2_AGENTC_REQUEST_IDENTITIES requests (and optionally a
+ * sign request with the first identity after each one) to the agent socket,
+ * first in lock-step (one request per write, wait for each reply), and then
+ * pipelined (a whole batch of requests in a single write). It checks that
+ * every request gets exactly one reply, in order, and prints the rate for
+ * each mode. With -o, every other pipelined request is one the agent always
+ * refuses, so that replies coming back out of order get noticed too.
+ *
+ * "make agent-bench" builds it, and "make check AGENT_SOCK=..." runs it with
+ * -o against a running agent.
+ *
+ * Usage:
+ *   agent-bench [-so] [-n count] [-b batch] /var/zonecontrol/<zone>/token.sock
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define	SSH_AGENT_FAILURE		5
+#define	SSH_AGENTC_REMOVE_ALL_RSA_IDENTITIES	9
+#define	SSH2_AGENTC_REQUEST_IDENTITIES	11
+#define	SSH2_AGENT_IDENTITIES_ANSWER	12
+#define	SSH2_AGENTC_SIGN_REQUEST	13
+#define	SSH2_AGENT_SIGN_RESPONSE	14
+
+#define	MAX_MSG		(256 * 1024)
+
+static uint8_t *keyblob = NULL;
+static size_t keybloblen = 0;
+
+static void
+put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static uint32_t
+get_u32(const uint8_t *p)
+{
+	return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	    ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
+
+static void
+write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t rv;
+
+	while (len > 0) {
+		rv = write(fd, buf, len);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv <= 0) {
+			perror("write");
+			exit(1);
+		}
+		buf += rv;
+		len -= rv;
+	}
+}
+
+static void
+read_all(int fd, uint8_t *buf, size_t len)
+{
+	ssize_t rv;
+
+	while (len > 0) {
+		rv = read(fd, buf, len);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv == 0) {
+			fprintf(stderr, "agent closed the connection\n");
+			exit(1);
+		}
+		if (rv < 0) {
+			perror("read");
+			exit(1);
+		}
+		buf += rv;
+		len -= rv;
+	}
+}
+
+/* Reads one reply from the agent and returns its type. */
+static uint8_t
+read_reply(int fd, uint8_t *buf, size_t *lenp)
+{
+	uint32_t len;
+
+	read_all(fd, buf, 4);
+	len = get_u32(buf);
+	if (len < 1 || len > MAX_MSG) {
+		fprintf(stderr, "bad reply length from agent: %u\n", len);
+		exit(1);
+	}
+	read_all(fd, buf, len);
+	if (lenp != NULL)
+		*lenp = len;
+	return (buf[0]);
+}
+
+/* Appends a request to buf, returns the new offset. */
+static size_t
+make_request(uint8_t *buf, size_t off, boolean_t sign)
+{
+	const uint8_t data[32] = { 0 };
+
+	if (!sign) {
+		put_u32(&buf[off], 1);
+		buf[off + 4] = SSH2_AGENTC_REQUEST_IDENTITIES;
+		return (off + 5);
+	}
+
+	put_u32(&buf[off], 1 + 4 + keybloblen + 4 + sizeof (data) + 4);
+	off += 4;
+	buf[off++] = SSH2_AGENTC_SIGN_REQUEST;
+	put_u32(&buf[off], keybloblen);
+	off += 4;
+	bcopy(keyblob, &buf[off], keybloblen);
+	off += keybloblen;
+	put_u32(&buf[off], sizeof (data));
+	off += 4;
+	bcopy(data, &buf[off], sizeof (data));
+	off += sizeof (data);
+	put_u32(&buf[off], 0);
+	off += 4;
+	return (off);
+}
+
+/* Appends a request the agent always answers with SSH_AGENT_FAILURE. */
+static size_t
+make_refused(uint8_t *buf, size_t off)
+{
+	put_u32(&buf[off], 1);
+	buf[off + 4] = SSH_AGENTC_REMOVE_ALL_RSA_IDENTITIES;
+	return (off + 5);
+}
+
+static void
+expect_reply(uint8_t type, uint8_t want)
+{
+	if (type != want) {
+		fprintf(stderr, "unexpected reply type %u (wanted %u)\n",
+		    type, want);
+		exit(1);
+	}
+}
+
+static void
+check_reply(uint8_t type, boolean_t sign)
+{
+	expect_reply(type, sign ? SSH2_AGENT_SIGN_RESPONSE :
+	    SSH2_AGENT_IDENTITIES_ANSWER);
+}
+
+static double
+elapsed(const struct timespec *t1, const struct timespec *t2)
+{
+	return ((t2->tv_sec - t1->tv_sec) +
+	    (t2->tv_nsec - t1->tv_nsec) / 1.0e9);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	struct timespec t1, t2;
+	uint8_t *req, *reply;
+	size_t off, len, i, j, reqsz;
+	size_t count = 1000, batch = 16;
+	boolean_t sign = B_FALSE, order = B_FALSE;
+	uint32_t n;
+	int c, fd;
+
+	while ((c = getopt(argc, argv, "son:b:")) != -1) {
+		switch (c) {
+		case 's':
+			sign = B_TRUE;
+			break;
+		case 'o':
+			order = B_TRUE;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: agent-bench [-so] [-n count] "
+			    "[-b batch] socket\n");
+			return (1);
+		}
+	}
+	if (optind >= argc || count < 1 || batch < 1) {
+		fprintf(stderr, "usage: agent-bench [-so] [-n count] "
+		    "[-b batch] socket\n");
+		return (1);
+	}
+
+	bzero(&addr, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, argv[optind], sizeof (addr.sun_path));
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return (1);
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof (addr)) != 0) {
+		perror("connect");
+		return (1);
+	}
+
+	reply = calloc(1, MAX_MSG);
+	if (reply == NULL)
+		return (1);
+
+	/* Grab the first identity's key blob, for the sign requests. */
+	off = make_request(reply, 0, B_FALSE);
+	write_all(fd, reply, off);
+	check_reply(read_reply(fd, reply, &len), B_FALSE);
+	n = get_u32(&reply[1]);
+	if (n < 1 && sign) {
+		fprintf(stderr, "agent has no identities to sign with\n");
+		return (1);
+	}
+	if (n >= 1) {
+		keybloblen = get_u32(&reply[5]);
+		if (keybloblen > len - 9) {
+			fprintf(stderr, "bad identities answer\n");
+			return (1);
+		}
+		keyblob = malloc(keybloblen);
+		if (keyblob == NULL)
+			return (1);
+		bcopy(&reply[9], keyblob, keybloblen);
+	}
+
+	reqsz = make_request(reply, 0, sign);
+	req = calloc(batch, reqsz);
+	if (req == NULL)
+		return (1);
+
+	/* Lock-step: one request per write, wait for each reply. */
+	(void) clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < count; ++i) {
+		off = make_request(req, 0, sign);
+		write_all(fd, req, off);
+		check_reply(read_reply(fd, reply, NULL), sign);
+	}
+	(void) clock_gettime(CLOCK_MONOTONIC, &t2);
+	printf("lock-step: %zu requests in %.3f s (%.1f req/s)\n", count,
+	    elapsed(&t1, &t2), count / elapsed(&t1, &t2));
+
+	/* Pipelined: a whole batch of requests in each write. */
+	(void) clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < count; i += batch) {
+		off = 0;
+		for (j = 0; j < batch && i + j < count; ++j) {
+			if (order && j % 2 == 1)
+				off = make_refused(req, off);
+			else
+				off = make_request(req, off, sign);
+		}
+		write_all(fd, req, off);
+		for (j = 0; j < batch && i + j < count; ++j) {
+			c = read_reply(fd, reply, NULL);
+			if (order && j % 2 == 1)
+				expect_reply(c, SSH_AGENT_FAILURE);
+			else
+				check_reply(c, sign);
+		}
+	}
+	(void) clock_gettime(CLOCK_MONOTONIC, &t2);
+	printf("pipelined (batch %zu): %zu requests in %.3f s (%.1f req/s)\n",
+	    batch, count, elapsed(&t1, &t2), count / elapsed(&t1, &t2));
+
+	(void) close(fd);
+	free(req);
+	free(reply);
+	free(keyblob);
+	return (0);
+}
@@ -22,6 +22,7 @@
 #include <strings.h>
 #include <ucred.h>
 #include <priv.h>
+#include <atomic.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -33,6 +34,8 @@
 #include <port.h>
 
 #include "softtoken.h"
+#include "softtoken_provider.h"
+#include "flightrec.h"
 #include "bunyan.h"
 #include "libssh/sshbuf.h"
 #include "libssh/sshkey.h"
@@ -57,16 +60,28 @@
  * us.
  *
  * The agent is multi-threaded in order to deal with multiple clients
- * effectively. We start up a pool of threads (currently fixed size) that all
- * loop in port_get() handling clients. Whichever thread finishes reading in
- * an entire command from the client does the crypto operations associated with
- * it, begins to write out the reply, and then returns to port_get().
+ * effectively. We start up a pool of threads that all loop in port_get()
+ * handling clients. The pool is elastic: it starts at a minimum size and grows
+ * (up to a maximum) whenever all of its threads are busy and there are still
+ * events waiting on the port, and threads that stay idle for a while exit
+ * again. Whichever thread finishes reading in an entire command from the
+ * client processes it.
+ *
+ * Cheap commands (like listing identities) are answered right there on the
+ * reactor thread. Signing requests are handed off to a separate pool of
+ * crypto threads (on their own port, cryport), so that a burst of slow RSA
+ * signatures can't hold up socket I/O for every other client. While a client
+ * has a signature outstanding, we leave its fd disassociated from clport, so
+ * nothing else touches its client_state; the crypto thread writes the reply
+ * into cs_out and then re-arms the fd on clport itself.
  *
  * The other thing the supervisor provides us with after forking is one end of
- * a pipe() that we use to communicate with it. We can send commands on the
- * pipe to ask the supervisor to lock and unlock keys (and populate or zero the
- * shared memory segments associated). We currently manage the use of this
- * pipe through the main thread which also handles accept()ing new connections.
+ * a pipe() that we use to communicate with it, along with a shared page of
+ * request/reply rings (struct ctl_rings). We put requests on the rings to ask
+ * the supervisor to lock and unlock keys (and populate or zero the shared
+ * memory segments associated), and use the pipe as a doorbell to tell each
+ * other when there's something new on a ring. We currently manage the rings
+ * and the pipe through the main thread.
  *
  * The protocol we speak to clients of the UDS is the OpenSSH agent protocol.
  * We re-use a lot of code from OpenSSH here, and you'll see similarities in the
@@ -77,7 +92,8 @@
 enum port_events {
 	EVENT_WANT_UNLOCK = 1,
 	EVENT_WANT_LOCK,
-	EVENT_STOP
+	EVENT_STOP,
+	EVENT_CRYPTO_JOB
 };
 
 struct client_state {
@@ -85,9 +101,9 @@ struct client_state {
 	int cs_fd;
 	struct sockaddr_un cs_peer;
 	ucred_t *cs_ucred;
+	struct sched_flow *cs_flow;
 	struct sshbuf *cs_in;
 	struct sshbuf *cs_out;
-	struct sshbuf *cs_req;
 	int cs_events;
 	struct client_state *cs_next;
 	struct client_state *cs_prev;
@@ -101,46 +117,615 @@ enum as_state {
 };
 struct agent_slot {
 	mutex_t as_mtx;
-	uint8_t as_cookie;
+	uint32_t as_reqid;	/* ctl_req ID of our pending lock/unlock */
 	enum as_state as_state;
-	cond_t as_stchg;
 	struct timespec as_lastused;
 	struct timespec as_renew;
 	size_t as_ref;
-	uint8_t as_renew_cookie;
+	struct sign_job *as_parked;	/* jobs waiting for us to unlock */
+	struct sign_job *as_parked_tail;
+	uint32_t as_renew_id;	/* and of our pending cert renewal */
+	u_char *as_pubblob;
+	size_t as_publen;
+	uint64_t as_pubhash;
+	u_char *as_issuer;	/* DER issuer Name we expect in cert payloads */
+	size_t as_issuerlen;
+
+	/* Counters for the stats@joyent.com extension. */
+	volatile uint64_t as_signs;
+	volatile uint64_t as_sign_errors;
+	uint64_t as_unlocks;		/* these are protected by as_mtx */
+	uint64_t as_locks;
+	uint64_t as_renews;
+	uint64_t as_renew_errors;
 };
 
 static int acport;
 static int mport;
-static uint8_t last_cookie;
+static volatile uint32_t last_reqseq;
 
 static mutex_t clients_mtx;
 static struct client_state *clients;
 static int clport;
+static int cryport;
+
+/*
+ * If set (via the TOKEN_PREFETCH environment variable), we start unlocking
+ * keys as soon as a client connects or lists our identities, rather than
+ * waiting for its first sign request to arrive.
+ */
+static boolean_t prefetch_unlock = B_FALSE;
 
 static const char *zone_uuid;
 static const char *zone_alias;
 static const char *zone_owner;
 static nvlist_t *zone_tags;
 
-#define	N_THREADS	8
-static thread_t reactor_threads[N_THREADS];
+/*
+ * A pool of threads that all loop in port_get() on the same event port and
+ * hand each event to wp_handler. See pool_worker() for how it grows and
+ * shrinks between wp_min and wp_max threads.
+ */
+struct worker_pool {
+	const char *wp_name;
+	int wp_port;
+	void (*wp_handler)(port_event_t *);
+	mutex_t wp_mtx;
+	cond_t wp_chg;
+	uint wp_min;
+	uint wp_max;
+	uint wp_nthreads;
+	uint wp_nbusy;
+	boolean_t wp_stopping;
+	uint64_t wp_events;		/* handled so far */
+	hrtime_t wp_busy;		/* total time spent in wp_handler */
+};
+
+/* Defaults for the size of the client reactor pool. */
+#define	POOL_MIN_THREADS	2
+#define	POOL_MAX_THREADS	64
+#define	POOL_THREADS_PER_CPU	4
+/* Seconds a pool thread above wp_min can sit idle before it exits. */
+#define	POOL_IDLE_SEC		30
+
+/*
+ * Every client asks us for the identities list, and the answer only changes
+ * when the supervisor renews a cert, so we keep a prebuilt copy of the whole
+ * SSH2_AGENT_IDENTITIES_ANSWER message (length included), along with the
+ * value of *token_cert_gen it was built from.
+ */
+static mutex_t ids_mtx;
+static struct sshbuf *ids_msg;
+static uint32_t ids_gen;
+static boolean_t ids_valid = B_FALSE;
+
+static struct worker_pool reactor_pool;
+static struct worker_pool crypto_pool;
 static thread_t acceptor_thread;
 
 extern void tspec_subtract(struct timespec *result, const struct timespec *x,
     const struct timespec *y);
 
-static inline uint8_t
-next_cookie(void)
+/* Lets us go straight from a ctl_req ID back to the slot it was for. */
+static struct token_slot *slots_by_id[256];
+
+/*
+ * Makes a new ID for a request to the supervisor about the given slot. IDs
+ * are never 0, and the low 8 bits are always the slot ID (see ctl_req).
+ */
+static uint32_t
+next_reqid(struct token_slot *slot)
+{
+	uint32_t seq;
+
+	do {
+		seq = atomic_inc_32_nv(&last_reqseq) & 0xffffff;
+	} while (seq == 0);
+	return ((seq << 8) | slot->ts_id);
+}
+
+/*
+ * Asks the main thread to unlock the key in a given slot, if it isn't already
+ * unlocked (or on its way). Must be called with as_mtx held.
+ */
+static void
+request_unlock(struct token_slot *slot)
+{
+	struct agent_slot *a = slot->ts_agent;
+
+	if (a->as_state != AS_LOCKED)
+		return;
+	a->as_reqid = next_reqid(slot);
+	fr_record(FR_SLOT_STATE, slot->ts_id, a->as_state, AS_UNLOCKING, 0);
+	a->as_state = AS_UNLOCKING;
+	SOFTTOKEN_UNLOCK_REQUEST((char *)slot->ts_name, a->as_reqid);
+	VERIFY0(port_send(mport, EVENT_WANT_UNLOCK, slot));
+}
+
+/*
+ * Speculatively unlocks all the slots of a given type, so that the work on the
+ * card overlaps with the client's next few protocol round trips. Nearly every
+ * connection we see is followed within milliseconds by a sign request.
+ *
+ * We also bump as_lastused so that the key stays unlocked for the full idle
+ * period after the prefetch, even if the sign request is a little slow.
+ */
+static void
+prefetch_slots(enum slot_type type)
+{
+	struct token_slot *slot;
+	struct agent_slot *a;
+
+	if (!prefetch_unlock)
+		return;
+
+	for (slot = token_slots; slot != NULL; slot = slot->ts_next) {
+		if (slot->ts_type != type)
+			continue;
+		a = slot->ts_agent;
+		mutex_enter(&a->as_mtx);
+		VERIFY0(clock_gettime(CLOCK_MONOTONIC, &a->as_lastused));
+		if (a->as_state == AS_LOCKED) {
+			bunyan_log(TRACE, "prefetching key unlock",
+			    "keyname", BNY_STRING, slot->ts_name, NULL);
+			request_unlock(slot);
+		}
+		mutex_exit(&a->as_mtx);
+	}
+}
+
+/* 64-bit FNV-1a, used to match key blobs sent by clients against our slots. */
+static uint64_t
+blob_hash(const u_char *blob, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		h ^= blob[i];
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+/*
+ * Finds the slot whose public key is exactly the given blob. Clients send back
+ * the blobs we gave them in the identities answer, so we can just compare the
+ * bytes against each slot's serialized public key (hash first, then the full
+ * blob) instead of parsing the key.
+ */
+static struct token_slot *
+find_slot_by_blob(const u_char *blob, size_t blen)
 {
-	if (++last_cookie == 0)
-		return (++last_cookie);
-	return (last_cookie);
+	struct token_slot *slot;
+	struct agent_slot *a;
+	uint64_t h = blob_hash(blob, blen);
+
+	for (slot = token_slots; slot != NULL; slot = slot->ts_next) {
+		a = slot->ts_agent;
+		if (a->as_pubhash == h && a->as_publen == blen &&
+		    bcmp(a->as_pubblob, blob, blen) == 0) {
+			return (slot);
+		}
+	}
+	return (NULL);
+}
+
+enum msg_err {
+	ERR_NOERROR = 0,
+	ERR_INCOMPLETE,
+	ERR_BADMSG,
+	ERR_DEFERRED	/* handed off to crypto_pool, don't re-arm yet */
+};
+
+/*
+ * A signing request waiting for (or running on) a crypto_pool thread. The
+ * data to be signed is still sitting in the client's cs_in, which we leave
+ * alone until the job is done (see consume_request()).
+ */
+struct sign_job {
+	struct client_state *sj_client;
+	struct token_slot *sj_slot;
+	const u_char *sj_data;
+	size_t sj_dlen;
+	uint32_t sj_flags;
+	size_t sj_reqlen;
+	struct sign_batch *sj_batch;	/* NULL unless part of a batch */
+	uint sj_idx;
+	struct sign_job *sj_next;	/* sched_flow queue linkage */
+	struct bunyan_timers *sj_tms;	/* added to the "sign" histograms */
+};
+
+/*
+ * The sign-batch@joyent.com extension lets a client ask for a whole set of
+ * signatures in one request. Each one becomes a sign_job of its own on
+ * crypto_pool, and whichever of them finishes last writes out the response.
+ */
+#define	EXT_SIGN_BATCH		"sign-batch@joyent.com"
+#define	SIGN_BATCH_MAX		64
+
+/* Returns a JSON object full of counters, see process_stats(). */
+#define	EXT_STATS		"stats@joyent.com"
+
+struct sign_result {
+	u_char *sr_sig;
+	size_t sr_slen;
+	boolean_t sr_ok;
+};
+
+struct sign_batch {
+	struct client_state *sb_client;
+	mutex_t sb_mtx;
+	uint sb_pending;
+	uint sb_n;
+	size_t sb_reqlen;
+	struct sign_result *sb_res;
+};
+
+/*
+ * Signing jobs don't go straight onto cryport: we queue them up per client
+ * process (by uid and pid -- a process with several connections open is still
+ * one client) and the crypto threads pick the next job to run using deficit
+ * round robin across the clients that have work waiting. Each job we queue
+ * posts one event to cryport, and the thread that picks it up runs whichever
+ * job is next in line (which may not be the one that posted the event).
+ *
+ * RSA signatures cost a lot more than ed25519 ones, so they're charged more
+ * against each client's quantum.
+ *
+ * Each client also has a token bucket on sign requests, if TOKEN_CLIENT_RATE
+ * is set in the environment (in signatures per second, with a burst size of
+ * TOKEN_CLIENT_BURST). Requests over the limit are failed straight away.
+ */
+#define	SCHED_QUANTUM		4
+#define	SCHED_COST_RSA		4
+#define	SCHED_COST_OTHER	1
+
+struct sched_flow {
+	uid_t sf_uid;
+	pid_t sf_pid;
+	uint sf_refs;
+	struct sched_flow *sf_next;
+	struct sched_flow *sf_prev;
+
+	struct sign_job *sf_head;
+	struct sign_job *sf_tail;
+	int sf_deficit;
+	boolean_t sf_active;
+	struct sched_flow *sf_anext;
+
+	uint64_t sf_tokens;		/* in thousandths */
+	uint64_t sf_refill_ms;
+	boolean_t sf_throttled;
+	uint64_t sf_nthrottled;
+};
+
+static mutex_t sched_mtx;
+static struct sched_flow *sched_flows;
+static struct sched_flow *sched_active, *sched_active_tail;
+static uint sched_rate = 0;
+static uint sched_burst = 0;
+
+/*
+ * Counters, logged periodically by the main thread, and returned (along with
+ * the per-slot and per-pool ones) by the stats@joyent.com extension.
+ */
+static struct agent_stats {
+	volatile uint64_t st_signs;
+	volatile uint64_t st_throttled;
+	volatile uint64_t st_clients;
+	volatile uint64_t st_accepted;
+	volatile uint64_t st_queued;		/* sign jobs waiting to run */
+	volatile uint64_t st_reqs[256];		/* by message type */
+} stats;
+static uint64_t start_ms;
+
+#define	STATS_INTERVAL		60
+
+static void
+log_stats(void)
+{
+	static uint64_t last_throttled = 0;
+	uint64_t throttled = stats.st_throttled;
+
+	bunyan_log((throttled != last_throttled) ? INFO : DEBUG,
+	    "agent stats",
+	    "clients", BNY_UINT64, stats.st_clients,
+	    "sign_jobs", BNY_UINT64, stats.st_signs,
+	    "throttled", BNY_UINT64, throttled, NULL);
+	last_throttled = throttled;
+}
+
+static uint64_t
+mono_ms(void)
+{
+	struct timespec ts;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static struct sched_flow *
+sched_flow_get(const ucred_t *uc)
+{
+	struct sched_flow *f;
+	uid_t uid = ucred_geteuid(uc);
+	pid_t pid = ucred_getpid(uc);
+
+	mutex_enter(&sched_mtx);
+	for (f = sched_flows; f != NULL; f = f->sf_next) {
+		if (f->sf_uid == uid && f->sf_pid == pid)
+			break;
+	}
+	if (f == NULL) {
+		f = calloc(1, sizeof (struct sched_flow));
+		VERIFY3P(f, !=, NULL);
+		f->sf_uid = uid;
+		f->sf_pid = pid;
+		f->sf_tokens = (uint64_t)sched_burst * 1000;
+		f->sf_refill_ms = mono_ms();
+		f->sf_next = sched_flows;
+		if (sched_flows != NULL)
+			sched_flows->sf_prev = f;
+		sched_flows = f;
+	}
+	++f->sf_refs;
+	mutex_exit(&sched_mtx);
+
+	return (f);
+}
+
+static void
+sched_flow_put(struct sched_flow *f)
+{
+	mutex_enter(&sched_mtx);
+	if (--f->sf_refs > 0) {
+		mutex_exit(&sched_mtx);
+		return;
+	}
+	VERIFY3P(f->sf_head, ==, NULL);
+	VERIFY(!f->sf_active);
+	if (f->sf_prev != NULL)
+		f->sf_prev->sf_next = f->sf_next;
+	if (f->sf_next != NULL)
+		f->sf_next->sf_prev = f->sf_prev;
+	if (sched_flows == f)
+		sched_flows = f->sf_next;
+	mutex_exit(&sched_mtx);
+
+	if (f->sf_nthrottled > 0) {
+		bunyan_log(INFO, "rate limited client has gone away",
+		    "client_pid", BNY_INT, (int)f->sf_pid,
+		    "client_euid", BNY_INT, (int)f->sf_uid,
+		    "throttled", BNY_UINT64, f->sf_nthrottled, NULL);
+	}
+	free(f);
+}
+
+/*
+ * Takes a token from the client's bucket for one signature. Returns B_FALSE
+ * if the client is over its rate limit.
+ */
+static boolean_t
+sched_admit(struct sched_flow *f)
+{
+	uint64_t now, cap;
+	boolean_t first = B_FALSE;
+
+	if (sched_rate == 0)
+		return (B_TRUE);
+
+	now = mono_ms();
+	cap = (uint64_t)sched_burst * 1000;
+
+	mutex_enter(&sched_mtx);
+	f->sf_tokens += (now - f->sf_refill_ms) * sched_rate;
+	if (f->sf_tokens > cap)
+		f->sf_tokens = cap;
+	f->sf_refill_ms = now;
+
+	if (f->sf_tokens >= 1000) {
+		f->sf_tokens -= 1000;
+		f->sf_throttled = B_FALSE;
+		mutex_exit(&sched_mtx);
+		return (B_TRUE);
+	}
+
+	if (!f->sf_throttled)
+		first = B_TRUE;
+	f->sf_throttled = B_TRUE;
+	++f->sf_nthrottled;
+	mutex_exit(&sched_mtx);
+
+	atomic_inc_64(&stats.st_throttled);
+	if (first) {
+		bunyan_log(INFO, "client is over its signing rate limit",
+		    "client_pid", BNY_INT, (int)f->sf_pid,
+		    "client_euid", BNY_INT, (int)f->sf_uid,
+		    "rate", BNY_UINT, sched_rate,
+		    "burst", BNY_UINT, sched_burst, NULL);
+	}
+	return (B_FALSE);
+}
+
+static int
+sched_cost(const struct sign_job *job)
+{
+	if (job->sj_slot->ts_algo == ALGO_RSA_2048)
+		return (SCHED_COST_RSA);
+	return (SCHED_COST_OTHER);
+}
+
+/* Queues a sign job for its client and wakes up a crypto thread. */
+static void
+sched_enqueue(struct sign_job *job)
+{
+	struct sched_flow *f = job->sj_client->cs_flow;
+
+	job->sj_tms = bny_timers_new();
+	VERIFY3P(job->sj_tms, !=, NULL);
+	VERIFY0(bny_timer_begin(job->sj_tms));
+
+	job->sj_next = NULL;
+	atomic_inc_64(&stats.st_queued);
+	SOFTTOKEN_SIGN_START((uintptr_t)job, (char *)job->sj_slot->ts_name,
+	    (int)ucred_getpid(job->sj_client->cs_ucred),
+	    (uint32_t)job->sj_dlen);
+	mutex_enter(&sched_mtx);
+	if (f->sf_tail == NULL)
+		f->sf_head = job;
+	else
+		f->sf_tail->sj_next = job;
+	f->sf_tail = job;
+	if (!f->sf_active) {
+		f->sf_active = B_TRUE;
+		f->sf_deficit = 0;
+		f->sf_anext = NULL;
+		if (sched_active_tail == NULL)
+			sched_active = f;
+		else
+			sched_active_tail->sf_anext = f;
+		sched_active_tail = f;
+	}
+	mutex_exit(&sched_mtx);
+
+	VERIFY0(port_send(cryport, EVENT_CRYPTO_JOB, NULL));
+}
+
+/*
+ * Picks the next job to run. The client at the front of the active list keeps
+ * going until it runs out of deficit, then goes to the back with a fresh
+ * quantum.
+ */
+static struct sign_job *
+sched_next(void)
+{
+	struct sched_flow *f;
+	struct sign_job *job;
+	int cost;
+
+	mutex_enter(&sched_mtx);
+	while (1) {
+		f = sched_active;
+		VERIFY3P(f, !=, NULL);
+		job = f->sf_head;
+		VERIFY3P(job, !=, NULL);
+		cost = sched_cost(job);
+		if (f->sf_deficit >= cost)
+			break;
+		f->sf_deficit += SCHED_QUANTUM;
+		if (f->sf_anext != NULL) {
+			sched_active = f->sf_anext;
+			f->sf_anext = NULL;
+			sched_active_tail->sf_anext = f;
+			sched_active_tail = f;
+		}
+	}
+
+	f->sf_deficit -= cost;
+	f->sf_head = job->sj_next;
+	if (f->sf_head == NULL) {
+		f->sf_tail = NULL;
+		f->sf_active = B_FALSE;
+		f->sf_deficit = 0;
+		sched_active = f->sf_anext;
+		if (sched_active == NULL)
+			sched_active_tail = NULL;
+		f->sf_anext = NULL;
+	}
+	mutex_exit(&sched_mtx);
+
+	job->sj_next = NULL;
+	atomic_dec_64(&stats.st_queued);
+	atomic_inc_64(&stats.st_signs);
+	return (job);
+}
+
+/*
+ * When clients go away we keep their client_state structs (along with their
+ * sshbufs and ucred) on a free list, so that a burst of short-lived
+ * connections doesn't have to allocate all of that again for every one.
+ *
+ * We also cap the number of clients we'll have open at once. When we hit the
+ * cap, the acceptor stops re-arming the listen socket (so new connections
+ * wait in the backlog) until close_client() brings us back under it. It does
+ * the same when accept() runs out of fds, and then the main loop also re-arms
+ * it on each tick, in case there are no clients to close.
+ *
+ * All of this is protected by clients_mtx.
+ */
+#define	CLIENT_POOL_MAX		64
+#define	DEFAULT_MAX_CLIENTS	1024
+
+static struct client_state *client_pool;
+static uint client_pool_n = 0;
+static uint nclients = 0;
+static uint max_clients = DEFAULT_MAX_CLIENTS;
+static boolean_t listen_paused = B_FALSE;
+static int listen_fd = -1;
+
+static struct client_state *
+client_get(void)
+{
+	struct client_state *cl;
+
+	mutex_enter(&clients_mtx);
+	cl = client_pool;
+	if (cl != NULL) {
+		client_pool = cl->cs_next;
+		--client_pool_n;
+	}
+	mutex_exit(&clients_mtx);
+
+	if (cl == NULL) {
+		cl = calloc(1, sizeof (struct client_state));
+		VERIFY3P(cl, !=, NULL);
+		cl->cs_in = sshbuf_new();
+		VERIFY3P(cl->cs_in, !=, NULL);
+		cl->cs_out = sshbuf_new();
+		VERIFY3P(cl->cs_out, !=, NULL);
+	}
+	cl->cs_next = NULL;
+	cl->cs_prev = NULL;
+	cl->cs_fd = -1;
+	return (cl);
+}
+
+static void
+client_put(struct client_state *cl)
+{
+	/* sshbuf_reset() zeroes the buffers, too. */
+	sshbuf_reset(cl->cs_in);
+	sshbuf_reset(cl->cs_out);
+	cl->cs_events = 0;
+	cl->cs_flow = NULL;
+	cl->cs_fd = -1;
+	bzero(&cl->cs_peer, sizeof (cl->cs_peer));
+
+	mutex_enter(&clients_mtx);
+	if (client_pool_n < CLIENT_POOL_MAX) {
+		cl->cs_prev = NULL;
+		cl->cs_next = client_pool;
+		client_pool = cl;
+		++client_pool_n;
+		cl = NULL;
+	}
+	mutex_exit(&clients_mtx);
+
+	if (cl != NULL) {
+		sshbuf_free(cl->cs_in);
+		sshbuf_free(cl->cs_out);
+		if (cl->cs_ucred != NULL)
+			ucred_free(cl->cs_ucred);
+		free(cl);
+	}
 }
 
 static void
 close_client(struct client_state *cl)
 {
+	boolean_t resume = B_FALSE;
+
 	mutex_enter(&clients_mtx);
 	if (cl->cs_prev != NULL)
 		cl->cs_prev->cs_next = cl->cs_next;
@@ -148,23 +733,65 @@ close_client(struct client_state *cl)
 		cl->cs_next->cs_prev = cl->cs_prev;
 	if (clients == cl)
 		clients = cl->cs_next;
+	--nclients;
+	if (listen_paused && nclients < max_clients) {
+		listen_paused = B_FALSE;
+		resume = B_TRUE;
+		VERIFY0(port_associate(acport,
+		    PORT_SOURCE_FD, listen_fd, POLLIN, NULL));
+	}
 	mutex_exit(&clients_mtx);
 
+	if (resume)
+		bunyan_log(DEBUG, "accepting new clients again", NULL);
+
+	SOFTTOKEN_CLIENT_CLOSE(cl->cs_fd);
+	fr_record(FR_CLIENT_CLOSE, cl->cs_fd, 0, 0, 0);
 	VERIFY0(close(cl->cs_fd));
-	cl->cs_events = 0;
-	sshbuf_free(cl->cs_in);
-	sshbuf_free(cl->cs_out);
-	ucred_free(cl->cs_ucred);
-	if (cl->cs_req != NULL)
-		sshbuf_free(cl->cs_req);
-	free(cl);
+	if (cl->cs_flow != NULL)
+		sched_flow_put(cl->cs_flow);
+	atomic_dec_64(&stats.st_clients);
+	client_put(cl);
 }
 
-enum msg_err {
-	ERR_NOERROR = 0,
-	ERR_INCOMPLETE,
-	ERR_BADMSG
-};
+/* How much space we reserve at the end of cs_in for each read(). */
+#define	CLIENT_READ_SIZE	4096
+
+/*
+ * Discards a request frame (length prefix included) from the front of cs_in
+ * once we're finished with it. The request may have contained data the client
+ * wanted signed, so we zero it first rather than leave it lying around in the
+ * buffer.
+ */
+static void
+consume_request(struct client_state *cl, size_t len)
+{
+	explicit_bzero(sshbuf_mutable_ptr(cl->cs_in), len);
+	VERIFY0(sshbuf_consume(cl->cs_in, len));
+}
+
+/*
+ * Responses are serialized straight into cs_out. msg_begin() writes a
+ * placeholder for the length and the message type, and returns the offset of
+ * the message so that msg_end() can fill in the real length afterwards.
+ */
+static size_t
+msg_begin(struct client_state *cl, uint8_t type)
+{
+	size_t off = sshbuf_len(cl->cs_out);
+
+	VERIFY0(sshbuf_put_u32(cl->cs_out, 0));
+	VERIFY0(sshbuf_put_u8(cl->cs_out, type));
+	return (off);
+}
+
+static void
+msg_end(struct client_state *cl, size_t off)
+{
+	u_char *p = sshbuf_mutable_ptr(cl->cs_out) + off;
+
+	POKE_U32(p, sshbuf_len(cl->cs_out) - off - 4);
+}
 
 static void
 send_status(struct client_state *cl, boolean_t success)
@@ -175,15 +802,12 @@ send_status(struct client_state *cl, boolean_t success)
 }
 
 static void
-process_request_identities(struct client_state *cl)
+build_identities(struct sshbuf *msg)
 {
-	struct sshbuf *msg;
 	struct token_slot *slot;
 	size_t n = 0;
 	char namebuf[256];
-
-	msg = sshbuf_new();
-	VERIFY3P(msg, !=, NULL);
+	u_char *p;
 
 	for (slot = token_slots; slot != NULL; slot = slot->ts_next) {
 		n++;
@@ -197,16 +821,14 @@ process_request_identities(struct client_state *cl)
 		}
 	}
 
+	sshbuf_reset(msg);
+	VERIFY0(sshbuf_put_u32(msg, 0));
 	VERIFY0(sshbuf_put_u8(msg, SSH2_AGENT_IDENTITIES_ANSWER));
 	VERIFY0(sshbuf_put_u32(msg, n));
 
 	for (slot = token_slots; slot != NULL; slot = slot->ts_next) {
-		u_char *blob;
-		size_t blen;
-
-		VERIFY0(sshkey_to_blob(slot->ts_public, &blob, &blen));
-		VERIFY0(sshbuf_put_string(msg, blob, blen));
-		free(blob);
+		VERIFY0(sshbuf_put_string(msg, slot->ts_agent->as_pubblob,
+		    slot->ts_agent->as_publen));
 
 		VERIFY0(sshbuf_put_cstring(msg, slot->ts_name));
 
@@ -229,70 +851,598 @@ process_request_identities(struct client_state *cl)
 			VERIFY0(sshbuf_put_cstring(msg, namebuf));
 		}
 	}
-	VERIFY0(sshbuf_put_stringb(cl->cs_out, msg));
-	sshbuf_free(msg);
+
+	p = sshbuf_mutable_ptr(msg);
+	POKE_U32(p, sshbuf_len(msg) - 4);
+}
+
+static void
+process_request_identities(struct client_state *cl)
+{
+	uint32_t gen;
+
+	mutex_enter(&ids_mtx);
+	gen = *token_cert_gen;
+	membar_consumer();
+	if (!ids_valid || gen != ids_gen) {
+		build_identities(ids_msg);
+		/*
+		 * If the supervisor was in the middle of writing out a new
+		 * cert while we were reading (the gen is odd, or moved under
+		 * us), this answer is still fine to send, but we mustn't keep
+		 * it around: build it again next time.
+		 */
+		membar_consumer();
+		ids_gen = gen;
+		ids_valid = ((gen & 1) == 0 && *token_cert_gen == gen);
+	}
+	VERIFY0(sshbuf_putb(cl->cs_out, ids_msg));
+	mutex_exit(&ids_mtx);
+}
+
+static void
+process_request_x509(struct client_state *cl, struct sshbuf *req)
+{
+	const u_char *blob;
+	size_t blen, off;
+	u_int flags = 0, count = 0;
+	struct sshbuf *msg = cl->cs_out;
+	struct token_slot *slot;
+
+	VERIFY0(sshbuf_get_string_direct(req, &blob, &blen));
+	VERIFY0(sshbuf_get_u32(req, &flags));
+
+	slot = find_slot_by_blob(blob, blen);
+	if (slot == NULL) {
+		send_status(cl, B_FALSE);
+		return;
+	}
+	if (slot->ts_type != SLOT_ASYM_CERT_SIGN) {
+		send_status(cl, B_FALSE);
+		return;
+	}
+
+	/*
+	 * Clients fetch the certificate chain right before asking us to sign
+	 * with the cert key, so this is a good time to get it unlocked.
+	 */
+	prefetch_slots(SLOT_ASYM_CERT_SIGN);
+
+	if (slot->ts_certdata->tsd_len > 0)
+		++count;
+	if (slot->ts_chaindata->tsd_len > 0)
+		++count;
+
+	off = msg_begin(cl, SSH2_AGENT_X509_RESPONSE);
+	VERIFY0(sshbuf_put_u32(msg, count));
+
+	if (slot->ts_certdata->tsd_len > 0) {
+		VERIFY0(sshbuf_put_string(msg,
+		    (const void *)slot->ts_certdata->tsd_data,
+		    slot->ts_certdata->tsd_len));
+	}
+	if (slot->ts_chaindata->tsd_len > 0) {
+		VERIFY0(sshbuf_put_string(msg,
+		    (const void *)slot->ts_chaindata->tsd_data,
+		    slot->ts_chaindata->tsd_len));
+	}
+
+	msg_end(cl, off);
+}
+
+/*
+ * Most cert signing requests are for exactly the kind of cert we expect, so
+ * before we fully decode a TBSCertificate in validate_cert_payload() we try a
+ * quick scan over its DER, comparing the interesting parts against templates
+ * built once at startup (see make_cert_templates()). This can only accept a
+ * payload: anything it doesn't like (or doesn't understand) goes through the
+ * full decode, which makes the real decision and logs why.
+ */
+struct der_blob {
+	u_char *db_ptr;
+	size_t db_len;
+};
+
+/*
+ * An attribute we allow in the subject of certs signed by a zone's cert key,
+ * and the only value it may have.
+ */
+struct name_attr {
+	struct der_blob na_oid;
+	const char *na_value;
+	boolean_t na_required;
+};
+
+#define	DER_SEQUENCE	(V_ASN1_SEQUENCE | V_ASN1_CONSTRUCTED)
+#define	DER_SET		(V_ASN1_SET | V_ASN1_CONSTRUCTED)
+#define	DER_CTX(n)	(V_ASN1_CONTEXT_SPECIFIC | V_ASN1_CONSTRUCTED | (n))
+#define	DER_CTX_PRIM(n)	(V_ASN1_CONTEXT_SPECIFIC | (n))
+
+static const char *sys_uuid, *sys_hostname, *sys_dc;
+
+static struct der_blob tmpl_sigalg;
+static struct der_blob oid_basic, oid_ku, oid_eku, oid_san;
+static struct name_attr subj_attrs[8];
+static size_t subj_nattrs = 0;
+
+/*
+ * Reads one TLV from [*pp, end) and advances *pp past it. We only handle the
+ * subset of DER that turns up in a TBSCertificate: single-byte tags and
+ * definite lengths of at most 3 bytes.
+ */
+static int
+der_next(const u_char **pp, const u_char *end, u_char *tagp,
+    const u_char **valp, size_t *lenp)
+{
+	const u_char *p = *pp;
+	size_t len, n;
+
+	if (end - p < 2)
+		return (-1);
+	*tagp = *p++;
+	if ((*tagp & 0x1f) == 0x1f)
+		return (-1);
+	len = *p++;
+	if ((len & 0x80) != 0) {
+		n = len & 0x7f;
+		if (n < 1 || n > 3 || (size_t)(end - p) < n)
+			return (-1);
+		for (len = 0; n > 0; --n)
+			len = (len << 8) | *p++;
+	}
+	if (len > (size_t)(end - p))
+		return (-1);
+	*valp = p;
+	*lenp = len;
+	*pp = p + len;
+	return (0);
+}
+
+static boolean_t
+der_eq(const u_char *p, size_t len, const struct der_blob *tmpl)
+{
+	return (len == tmpl->db_len && bcmp(p, tmpl->db_ptr, len) == 0);
+}
+
+/* Reads one TLV and checks that its complete encoding matches a template. */
+static int
+der_match(const u_char **pp, const u_char *end, const struct der_blob *tmpl)
+{
+	const u_char *start = *pp, *v;
+	size_t len;
+	u_char tag;
+
+	if (der_next(pp, end, &tag, &v, &len) != 0)
+		return (-1);
+	if (!der_eq(start, *pp - start, tmpl))
+		return (-1);
+	return (0);
+}
+
+static int
+der_check_validity(const u_char *p, size_t len)
+{
+	const u_char *end = p + len;
+	ASN1_TIME *notbefore = NULL, *notafter = NULL;
+	time_t tm;
+	int rv = -1;
+
+	if (d2i_ASN1_TIME(&notbefore, &p, end - p) == NULL)
+		goto out;
+	if (d2i_ASN1_TIME(&notafter, &p, end - p) == NULL)
+		goto out;
+	if (p != end)
+		goto out;
+
+	if (X509_cmp_current_time(notbefore) > 0)
+		goto out;
+	if (X509_cmp_current_time(notafter) <= 0)
+		goto out;
+	tm = time(NULL);
+	tm += 305;
+	if (X509_cmp_time(notafter, &tm) >= 0)
+		goto out;
+	rv = 0;
+
+out:
+	ASN1_TIME_free(notbefore);
+	ASN1_TIME_free(notafter);
+	return (rv);
+}
+
+/*
+ * Checks the contents of a subject Name against subj_attrs: every RDN must be
+ * a single attribute we know about, with exactly the value we expect, and all
+ * the required ones have to be there.
+ */
+static int
+der_check_subject(const u_char *p, size_t len)
+{
+	const u_char *end = p + len, *rdn, *rend, *atv, *aend, *oid, *val;
+	size_t rlen, alen, vlen, i;
+	uint found = 0, required = 0;
+	u_char tag;
+
+	for (i = 0; i < subj_nattrs; ++i) {
+		if (subj_attrs[i].na_required)
+			required |= (1 << i);
+	}
+
+	while (p < end) {
+		if (der_next(&p, end, &tag, &rdn, &rlen) != 0 ||
+		    tag != DER_SET) {
+			return (-1);
+		}
+		rend = rdn + rlen;
+		if (der_next(&rdn, rend, &tag, &atv, &alen) != 0 ||
+		    tag != DER_SEQUENCE || rdn != rend) {
+			return (-1);
+		}
+		aend = atv + alen;
+		for (i = 0; i < subj_nattrs; ++i) {
+			oid = atv;
+			if (der_match(&oid, aend, &subj_attrs[i].na_oid) == 0)
+				break;
+		}
+		if (i >= subj_nattrs)
+			return (-1);
+		if (der_next(&oid, aend, &tag, &val, &vlen) != 0 ||
+		    oid != aend) {
+			return (-1);
+		}
+		if (tag != V_ASN1_UTF8STRING && tag != V_ASN1_PRINTABLESTRING &&
+		    tag != V_ASN1_IA5STRING) {
+			return (-1);
+		}
+		if (vlen != strlen(subj_attrs[i].na_value) ||
+		    bcmp(val, subj_attrs[i].na_value, vlen) != 0) {
+			return (-1);
+		}
+		found |= (1 << i);
+	}
+
+	if ((found & required) != required)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Checks a subjectAltName extension value: only DNS names matching the zone
+ * UUID and directory names identical to the subject are allowed.
+ */
+static int
+der_check_san(const u_char *p, size_t len, const u_char *subj, size_t subjlen)
+{
+	const u_char *end = p + len, *names, *nend, *v;
+	size_t nlen, vlen;
+	u_char tag;
+
+	if (der_next(&p, end, &tag, &names, &nlen) != 0 ||
+	    tag != DER_SEQUENCE || p != end) {
+		return (-1);
+	}
+	nend = names + nlen;
+	while (names < nend) {
+		if (der_next(&names, nend, &tag, &v, &vlen) != 0)
+			return (-1);
+		switch (tag) {
+		case DER_CTX_PRIM(GEN_DNS):
+			if (vlen != strlen(zone_uuid) ||
+			    bcmp(v, zone_uuid, vlen) != 0) {
+				return (-1);
+			}
+			break;
+		case DER_CTX(GEN_DIRNAME):
+			if (vlen != subjlen || bcmp(v, subj, vlen) != 0)
+				return (-1);
+			break;
+		default:
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Walks the Extensions in a TBSCertificate. For the GZ we only check that
+ * they're well-formed (the full decode doesn't look at them either), for
+ * zones we apply the same rules as validate_cert_payload().
+ */
+static int
+der_check_exts(const u_char *p, size_t len, boolean_t check,
+    const u_char *subj, size_t subjlen)
+{
+	const u_char *end = p + len, *exts, *eend, *ext, *xend, *oid, *v;
+	size_t elen, xlen, vlen, oidlen;
+	boolean_t has_basic = B_FALSE, has_ku = B_FALSE;
+	u_char tag;
+
+	if (der_next(&p, end, &tag, &exts, &elen) != 0 ||
+	    tag != DER_SEQUENCE || p != end || elen == 0) {
+		return (-1);
+	}
+	eend = exts + elen;
+	while (exts < eend) {
+		if (der_next(&exts, eend, &tag, &ext, &xlen) != 0 ||
+		    tag != DER_SEQUENCE) {
+			return (-1);
+		}
+		xend = ext + xlen;
+		oid = ext;
+		if (der_next(&ext, xend, &tag, &v, &vlen) != 0 ||
+		    tag != V_ASN1_OBJECT) {
+			return (-1);
+		}
+		oidlen = ext - oid;
+		if (der_next(&ext, xend, &tag, &v, &vlen) != 0)
+			return (-1);
+		if (tag == V_ASN1_BOOLEAN &&
+		    der_next(&ext, xend, &tag, &v, &vlen) != 0) {
+			return (-1);
+		}
+		if (tag != V_ASN1_OCTET_STRING || ext != xend)
+			return (-1);
+
+		if (!check)
+			continue;
+
+		if (der_eq(oid, oidlen, &oid_basic)) {
+			/* An empty BasicConstraints is CA:FALSE. */
+			if (vlen != 2 || v[0] != DER_SEQUENCE || v[1] != 0)
+				return (-1);
+			has_basic = B_TRUE;
+		} else if (der_eq(oid, oidlen, &oid_ku)) {
+			if (vlen < 3 || v[0] != V_ASN1_BIT_STRING ||
+			    v[1] != vlen - 2) {
+				return (-1);
+			}
+			/* Bits 5 and 6 are keyCertSign and cRLSign */
+			if (vlen > 3 && (v[3] & 0x06) != 0)
+				return (-1);
+			has_ku = B_TRUE;
+		} else if (der_eq(oid, oidlen, &oid_eku)) {
+			continue;
+		} else if (der_eq(oid, oidlen, &oid_san)) {
+			if (der_check_san(v, vlen, subj, subjlen) != 0)
+				return (-1);
+		} else {
+			return (-1);
+		}
+	}
+
+	if (check && (!has_basic || !has_ku))
+		return (-1);
+	return (0);
+}
+
+/* Checks the contents of a SubjectPublicKeyInfo are at least well-formed. */
+static int
+der_check_spki(const u_char *p, size_t len)
+{
+	const u_char *end = p + len, *v;
+	size_t vlen;
+	u_char tag;
+
+	if (der_next(&p, end, &tag, &v, &vlen) != 0 ||
+	    tag != DER_SEQUENCE || vlen < 2 || v[0] != V_ASN1_OBJECT) {
+		return (-1);
+	}
+	if (der_next(&p, end, &tag, &v, &vlen) != 0 ||
+	    tag != V_ASN1_BIT_STRING || vlen < 1 || p != end) {
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Returns 0 if the payload is definitely acceptable, or -1 if we need to take
+ * the slow path to find out.
+ */
+static int
+cert_payload_fast(struct client_state *cl, struct token_slot *slot,
+    const u_char *data, size_t dlen)
+{
+	const u_char *p = data, *end = data + dlen, *v, *ver, *subj, *subjv;
+	size_t len, subjlen, subjvlen;
+	boolean_t zone = (cl->cs_zid != GLOBAL_ZONEID);
+	struct der_blob issuer;
+	u_char tag;
+
+	issuer.db_ptr = slot->ts_agent->as_issuer;
+	issuer.db_len = slot->ts_agent->as_issuerlen;
+	if (issuer.db_ptr == NULL || tmpl_sigalg.db_ptr == NULL)
+		return (-1);
+
+	if (der_next(&p, end, &tag, &v, &len) != 0 || tag != DER_SEQUENCE ||
+	    p != end) {
+		return (-1);
+	}
+	p = v;
+	end = v + len;
+
+	/* version (optional) and serialNumber */
+	if (der_next(&p, end, &tag, &v, &len) != 0)
+		return (-1);
+	if (tag == DER_CTX(0)) {
+		ver = v;
+		if (der_next(&ver, v + len, &tag, &v, &len) != 0 ||
+		    tag != V_ASN1_INTEGER) {
+			return (-1);
+		}
+		if (der_next(&p, end, &tag, &v, &len) != 0)
+			return (-1);
+	}
+	if (tag != V_ASN1_INTEGER || len < 1)
+		return (-1);
+
+	/* signature */
+	if (der_match(&p, end, &tmpl_sigalg) != 0)
+		return (-1);
+
+	/* issuer */
+	if (der_match(&p, end, &issuer) != 0)
+		return (-1);
+
+	/* validity */
+	if (der_next(&p, end, &tag, &v, &len) != 0 || tag != DER_SEQUENCE)
+		return (-1);
+	if (der_check_validity(v, len) != 0)
+		return (-1);
+
+	/* subject */
+	subj = p;
+	if (der_next(&p, end, &tag, &subjv, &subjvlen) != 0 ||
+	    tag != DER_SEQUENCE) {
+		return (-1);
+	}
+	subjlen = p - subj;
+	if (zone && der_check_subject(subjv, subjvlen) != 0)
+		return (-1);
+
+	/* subjectPublicKeyInfo */
+	if (der_next(&p, end, &tag, &v, &len) != 0 || tag != DER_SEQUENCE)
+		return (-1);
+	if (der_check_spki(v, len) != 0)
+		return (-1);
+
+	/* extensions (we don't expect issuer/subjectUniqueID) */
+	if (p == end)
+		return (zone ? -1 : 0);
+	if (der_next(&p, end, &tag, &v, &len) != 0 || tag != DER_CTX(3) ||
+	    p != end) {
+		return (-1);
+	}
+	return (der_check_exts(v, len, zone, subj, subjlen));
+}
+
+static void
+make_oid(int nid, struct der_blob *blob)
+{
+	ASN1_OBJECT *obj;
+	int len;
+
+	obj = OBJ_nid2obj(nid);
+	VERIFY(obj != NULL);
+	blob->db_ptr = NULL;
+	len = i2d_ASN1_OBJECT(obj, &blob->db_ptr);
+	VERIFY3S(len, >, 0);
+	blob->db_len = len;
+}
+
+static void
+add_subj_attr(int nid, const char *value, boolean_t required)
+{
+	VERIFY3U(subj_nattrs, <, sizeof (subj_attrs) / sizeof (subj_attrs[0]));
+	make_oid(nid, &subj_attrs[subj_nattrs].na_oid);
+	subj_attrs[subj_nattrs].na_value = value;
+	subj_attrs[subj_nattrs].na_required = required;
+	++subj_nattrs;
+}
+
+static void
+add_name_entry(X509_NAME *name, const char *field, const char *value)
+{
+	VERIFY3S(X509_NAME_add_entry_by_txt(name, field, MBSTRING_ASC,
+	    (unsigned char *)value, -1, -1, 0), ==, 1);
+}
+
+/*
+ * Builds the issuer Name we expect to see in payloads for a cert signing slot.
+ * Clients get this from the subject of the cert we hand out for the slot, so
+ * it has to be built exactly the way the supervisor builds that (see
+ * new_cert_global_x509() and new_cert_zone_x509()).
+ */
+static void
+make_issuer_template(struct token_slot *slot, zoneid_t zid, nvlist_t *zinfo)
+{
+	X509_NAME *name;
+	char *dc;
+	u_char *der = NULL;
+	int len;
+
+	name = X509_NAME_new();
+	VERIFY(name != NULL);
+
+	add_name_entry(name, "title", slot->ts_name);
+	if (zid == GLOBAL_ZONEID) {
+		add_name_entry(name, "CN", sys_hostname);
+		add_name_entry(name, "UID", sys_uuid);
+		if (strlen(sys_dc) > 0)
+			add_name_entry(name, "DC", sys_dc);
+		add_name_entry(name, "OU", "nodes");
+	} else {
+		add_name_entry(name, "CN", zone_uuid);
+		add_name_entry(name, "GN", zone_alias);
+		add_name_entry(name, "UID", zone_owner);
+		if (nvlist_lookup_string(zinfo, "datacenter_name", &dc) == 0) {
+			/*
+			 * The full check only takes SYSTEM_DC, so if the zone
+			 * thinks it's somewhere else, leave it to that.
+			 */
+			if (strcmp(dc, sys_dc) != 0) {
+				X509_NAME_free(name);
+				return;
+			}
+			add_name_entry(name, "DC", dc);
+		}
+		add_name_entry(name, "OU", "instances");
+	}
+	add_name_entry(name, "O", "triton");
+
+	len = i2d_X509_NAME(name, &der);
+	VERIFY3S(len, >, 0);
+	slot->ts_agent->as_issuer = der;
+	slot->ts_agent->as_issuerlen = len;
+
+	X509_NAME_free(name);
 }
 
 static void
-process_request_x509(struct client_state *cl)
+make_cert_templates(zoneid_t zid)
 {
-	struct sshkey *key = NULL;
-	u_char *blob = NULL;
-	size_t blen;
-	u_int flags = 0, count = 0;
-	struct sshbuf *msg = NULL;
-	struct token_slot *slot;
-
-	VERIFY0(sshbuf_get_string(cl->cs_req, &blob, &blen));
-	VERIFY0(sshbuf_get_u32(cl->cs_req, &flags));
-
-	VERIFY0(sshkey_from_blob(blob, blen, &key));
-	for (slot = token_slots; slot != NULL; slot = slot->ts_next) {
-		if (sshkey_equal_public(key, slot->ts_public))
-			break;
-	}
-	if (slot == NULL) {
-		send_status(cl, B_FALSE);
-		goto out;
-	}
-	if (slot->ts_type != SLOT_ASYM_CERT_SIGN) {
-		send_status(cl, B_FALSE);
-		goto out;
+	X509_ALGOR *alg;
+	int len;
+
+	sys_dc = getenv("SYSTEM_DC");
+	if (sys_dc == NULL)
+		sys_dc = "";
+	if (zid == GLOBAL_ZONEID) {
+		sys_uuid = getenv("SYSTEM_UUID");
+		VERIFY(sys_uuid != NULL);
+		VERIFY3U(strlen(sys_uuid), >, 0);
+		sys_hostname = getenv("SYSTEM_HOSTNAME");
+		VERIFY(sys_hostname != NULL);
 	}
 
-	if (slot->ts_certdata->tsd_len > 0)
-		++count;
-	if (slot->ts_chaindata->tsd_len > 0)
-		++count;
-
-	msg = sshbuf_new();
-	VERIFY(msg != NULL);
-
-	VERIFY0(sshbuf_put_u8(msg, SSH2_AGENT_X509_RESPONSE));
-	VERIFY0(sshbuf_put_u32(msg, count));
-
-	if (slot->ts_certdata->tsd_len > 0) {
-		VERIFY0(sshbuf_put_string(msg,
-		    (const void *)slot->ts_certdata->tsd_data,
-		    slot->ts_certdata->tsd_len));
-	}
-	if (slot->ts_chaindata->tsd_len > 0) {
-		VERIFY0(sshbuf_put_string(msg,
-		    (const void *)slot->ts_chaindata->tsd_data,
-		    slot->ts_chaindata->tsd_len));
+	alg = X509_ALGOR_new();
+	VERIFY(alg != NULL);
+	VERIFY3S(X509_ALGOR_set0(alg, OBJ_nid2obj(NID_sha256WithRSAEncryption),
+	    V_ASN1_NULL, NULL), ==, 1);
+	tmpl_sigalg.db_ptr = NULL;
+	len = i2d_X509_ALGOR(alg, &tmpl_sigalg.db_ptr);
+	VERIFY3S(len, >, 0);
+	tmpl_sigalg.db_len = len;
+	X509_ALGOR_free(alg);
+
+	make_oid(NID_basic_constraints, &oid_basic);
+	make_oid(NID_key_usage, &oid_ku);
+	make_oid(NID_ext_key_usage, &oid_eku);
+	make_oid(NID_subject_alt_name, &oid_san);
+
+	if (zid != GLOBAL_ZONEID) {
+		add_subj_attr(NID_commonName, zone_uuid, B_TRUE);
+		add_subj_attr(NID_title, "in-zone.key", B_TRUE);
+		add_subj_attr(NID_userId, zone_owner, B_FALSE);
+		add_subj_attr(NID_domainComponent, sys_dc, B_FALSE);
+		add_subj_attr(NID_givenName, zone_alias, B_FALSE);
+		add_subj_attr(NID_organizationalUnitName, "delegated", B_TRUE);
+		add_subj_attr(NID_organizationName, "triton", B_TRUE);
 	}
-
-	VERIFY0(sshbuf_put_stringb(cl->cs_out, msg));
-
-out:
-	sshbuf_free(msg);
-	sshkey_free(key);
-	free(blob);
 }
 
 static int
 validate_cert_payload(struct client_state *cl, struct token_slot *slot,
-    u_char *data, size_t dlen)
+    const u_char *data, size_t dlen)
 {
 	X509_CINF *cinf = NULL;
 	X509_NAME *issu, *subj;
@@ -302,7 +1452,7 @@ validate_cert_payload(struct client_state *cl, struct token_slot *slot,
 	time_t tm;
 	ASN1_STRING *str;
 	const char *d, *ou;
-	u_char *ptr;
+	const u_char *ptr;
 	int i, j, count;
 	const char *uuid = NULL, *hostname = NULL;
 	boolean_t issu_has_uuid = B_FALSE, subj_has_uuid = B_FALSE,
@@ -318,8 +1468,11 @@ validate_cert_payload(struct client_state *cl, struct token_slot *slot,
 		return (0);
 	}
 
+	if (cert_payload_fast(cl, slot, data, dlen) == 0)
+		return (0);
+
 	ptr = data;
-	if (d2i_X509_CINF(&cinf, (const u_char **)&ptr, dlen) == NULL) {
+	if (d2i_X509_CINF(&cinf, &ptr, dlen) == NULL) {
 		char errbuf[128];
 		unsigned long err = ERR_peek_last_error();
 		ERR_load_crypto_strings();
@@ -370,12 +1523,8 @@ validate_cert_payload(struct client_state *cl, struct token_slot *slot,
 	subj = cinf->subject;
 
 	if (cl->cs_zid == GLOBAL_ZONEID) {
-		uuid = getenv("SYSTEM_UUID");
-		VERIFY(uuid != NULL);
-		VERIFY3U(strlen(uuid), >, 0);
-
-		hostname = getenv("SYSTEM_HOSTNAME");
-		VERIFY(hostname != NULL);
+		uuid = sys_uuid;
+		hostname = sys_hostname;
 
 		count = X509_NAME_entry_count(issu);
 		for (i = 0; i < count; ++i) {
@@ -417,7 +1566,7 @@ validate_cert_payload(struct client_state *cl, struct token_slot *slot,
 				issu_has_uuid = B_TRUE;
 				break;
 			case NID_domainComponent:
-				if (strcmp(d, getenv("SYSTEM_DC")) != 0) {
+				if (strcmp(d, sys_dc) != 0) {
 					bunyan_log(TRACE, "issu DC= invalid",
 					    "value", BNY_STRING, d,
 					    NULL);
@@ -496,7 +1645,7 @@ validate_cert_payload(struct client_state *cl, struct token_slot *slot,
 				}
 				break;
 			case NID_domainComponent:
-				if (strcmp(d, getenv("SYSTEM_DC")) != 0) {
+				if (strcmp(d, sys_dc) != 0) {
 					bunyan_log(TRACE, "issu DC= invalid",
 					    "value", BNY_STRING, d,
 					    NULL);
@@ -583,7 +1732,7 @@ validate_cert_payload(struct client_state *cl, struct token_slot *slot,
 			}
 			break;
 		case NID_domainComponent:
-			if (strcmp(d, getenv("SYSTEM_DC")) != 0) {
+			if (strcmp(d, sys_dc) != 0) {
 				bunyan_log(TRACE, "subj DC= invalid",
 				    "value", BNY_STRING, d,
 				    NULL);
@@ -759,147 +1908,712 @@ err:
 
 }
 
+/*
+ * Takes a hold on the key in a job's slot so that it can't be re-locked under
+ * us, and maps its shared pages readable. If the key isn't unlocked yet, we
+ * ask for the unlock and park the job on the slot instead: handle_reply()
+ * sends it back to crypto_pool once the unlock is done. That way no crypto_pool
+ * thread sits around waiting on the card. Returns B_FALSE if the job was
+ * parked.
+ */
+static boolean_t
+slot_hold(struct sign_job *job)
+{
+	struct token_slot *slot = job->sj_slot;
+	struct agent_slot *a = slot->ts_agent;
+
+	mutex_enter(&a->as_mtx);
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &a->as_lastused));
+
+	if (a->as_state != AS_UNLOCKED) {
+		request_unlock(slot);
+		job->sj_next = NULL;
+		if (a->as_parked_tail == NULL)
+			a->as_parked = job;
+		else
+			a->as_parked_tail->sj_next = job;
+		a->as_parked_tail = job;
+		mutex_exit(&a->as_mtx);
+		return (B_FALSE);
+	}
+	VERIFY3U(slot->ts_data->tsd_len, >, 0);
+
+	/*
+	 * The shared pages are mapped PROT_NONE on our side until the data is
+	 * in use. While the refcount > 0, we change it to PROT_READ. Whichever
+	 * thread is responsible for decrementing the refcnt to 0 changes it
+	 * back to PROT_NONE.
+	 *
+	 * This way while the key material is waiting to be re-locked (during
+	 * the 5-sec timeout period), it's not trivially readable in this
+	 * process.
+	 */
+	if (++a->as_ref == 1) {
+		VERIFY0(mprotect((caddr_t)slot->ts_data, slot->ts_datasize,
+		    PROT_READ));
+	}
+	mutex_exit(&a->as_mtx);
+	return (B_TRUE);
+}
+
+/* Drops the hold taken by slot_hold(). */
 static void
-process_sign_request(struct client_state *cl)
+slot_rele(struct token_slot *slot)
+{
+	struct agent_slot *a = slot->ts_agent;
+
+	mutex_enter(&a->as_mtx);
+	if (--a->as_ref == 0) {
+		VERIFY0(mprotect((caddr_t)slot->ts_data, slot->ts_datasize,
+		    PROT_NONE));
+	}
+	mutex_exit(&a->as_mtx);
+}
+
+/*
+ * Signs some data with the key in a given slot, which the caller must have a
+ * hold on (see slot_hold()). Drops the hold as soon as the key is read out of
+ * the shared pages.
+ */
+static int
+slot_sign(struct token_slot *slot, const u_char *data, size_t dlen,
+    uint32_t flags, struct bunyan_timers *tms, u_char **sigp, size_t *slenp)
 {
-	struct sshbuf *msg, *kbuf;
-	struct sshkey *key;
+	struct sshbuf *kbuf;
 	struct sshkey *privkey;
-	struct token_slot *slot;
-	u_char *blob, *data, *sig = NULL;
-	size_t blen, dlen, slen = 0;
-	int rv;
-	uint32_t flags, compat = 0;
 	struct agent_slot *a;
 	const char *alg = NULL;
-
-	VERIFY0(sshbuf_get_string(cl->cs_req, &blob, &blen));
-	VERIFY0(sshbuf_get_string(cl->cs_req, &data, &dlen));
-	VERIFY0(sshbuf_get_u32(cl->cs_req, &flags));
+	uint32_t compat = 0;
+	int rv;
 
 	/*if (flags & SSH_AGENT_OLD_SIGNATURE)
 		compat = SSH_BUG_SIGBLOB;*/
 
-	VERIFY0(sshkey_from_blob(blob, blen, &key));
-	for (slot = token_slots; slot != NULL; slot = slot->ts_next) {
-		if (sshkey_equal_public(key, slot->ts_public))
-			break;
+	a = slot->ts_agent;
+	VERIFY3U(a->as_state, ==, AS_UNLOCKED);
+	VERIFY3U(a->as_ref, >, 0);
+
+	kbuf = sshbuf_from((const void *)slot->ts_data->tsd_data,
+	    slot->ts_data->tsd_len);
+	VERIFY3P(kbuf, !=, NULL);
+	VERIFY0(sshkey_private_deserialize(kbuf, &privkey));
+	sshbuf_free(kbuf);
+
+	/* We're done with the shared memory now, so we can release it. */
+	slot_rele(slot);
+
+	if (privkey->type == KEY_RSA) {
+		if (flags & SSH_AGENT_RSA_SHA2_256)
+			alg = "rsa-sha2-256";
+		else if (flags & SSH_AGENT_RSA_SHA2_512)
+			alg = "rsa-sha2-512";
 	}
-	if (slot == NULL) {
+	rv = sshkey_sign(privkey, sigp, slenp, data, dlen, alg, compat);
+	sshkey_free(privkey);
+
+	if (tms != NULL)
+		VERIFY0(bny_timer_next(tms, "sign"));
+	if (rv == 0)
+		atomic_inc_64(&a->as_signs);
+	else
+		atomic_inc_64(&a->as_sign_errors);
+
+	return (rv);
+}
+
+/*
+ * Runs on a crypto_pool thread: validates the payload (for the cert signing
+ * key) and does the signature. The caller must have a hold on the job's slot,
+ * which we drop. Returns non-zero if the payload wasn't valid.
+ */
+static int
+do_sign_job(struct sign_job *job, u_char **sigp, size_t *slenp)
+{
+	struct token_slot *slot = job->sj_slot;
+	int rv;
+
+	if (slot->ts_type == SLOT_ASYM_CERT_SIGN) {
+		rv = validate_cert_payload(job->sj_client, slot, job->sj_data,
+		    job->sj_dlen);
+		if (rv != 0) {
+			slot_rele(slot);
+			SOFTTOKEN_SIGN_DONE((uintptr_t)job,
+			    (char *)slot->ts_name, rv);
+			return (rv);
+		}
+		VERIFY0(bny_timer_next(job->sj_tms, "validate"));
+	}
+
+	VERIFY0(slot_sign(slot, job->sj_data, job->sj_dlen, job->sj_flags,
+	    job->sj_tms, sigp, slenp));
+	bny_timers_record(job->sj_tms, "sign");
+	SOFTTOKEN_SIGN_DONE((uintptr_t)job, (char *)slot->ts_name, 0);
+	return (0);
+}
+
+static void
+free_sign_job(struct sign_job *job)
+{
+	if (job->sj_tms != NULL)
+		bny_timers_free(job->sj_tms);
+	free(job);
+}
+
+/* Does a single sign request and puts the response into the client's cs_out. */
+static void
+run_sign_job(struct sign_job *job)
+{
+	struct client_state *cl = job->sj_client;
+	u_char *sig = NULL;
+	size_t slen = 0, off;
+
+	if (do_sign_job(job, &sig, &slen) != 0) {
 		send_status(cl, B_FALSE);
-		goto out;
+		return;
 	}
 
-	switch (slot->ts_type) {
-	case SLOT_ASYM_CERT_SIGN:
-		rv = validate_cert_payload(cl, slot, data, dlen);
-		if (rv != 0) {
-			send_status(cl, B_FALSE);
-			goto out;
+	off = msg_begin(cl, SSH2_AGENT_SIGN_RESPONSE);
+	VERIFY0(sshbuf_put_string(cl->cs_out, sig, slen));
+	msg_end(cl, off);
+
+	explicit_bzero(sig, slen);
+	free(sig);
+}
+
+/*
+ * Writes out the response to a finished sign-batch@joyent.com request:
+ *
+ *	byte		SSH_AGENT_SUCCESS
+ *	uint32		count
+ *	count times:
+ *		byte	1 if signed, 0 if not (unknown key, bad payload)
+ *		string	signature (empty if not signed)
+ *
+ * with the results in the same order as the requests.
+ */
+static void
+finish_sign_batch(struct sign_batch *b)
+{
+	struct client_state *cl = b->sb_client;
+	struct sign_result *r;
+	size_t off;
+	uint i;
+
+	off = msg_begin(cl, SSH_AGENT_SUCCESS);
+	VERIFY0(sshbuf_put_u32(cl->cs_out, b->sb_n));
+	for (i = 0; i < b->sb_n; ++i) {
+		r = &b->sb_res[i];
+		VERIFY0(sshbuf_put_u8(cl->cs_out, r->sr_ok ? 1 : 0));
+		VERIFY0(sshbuf_put_string(cl->cs_out, r->sr_sig, r->sr_slen));
+		if (r->sr_sig != NULL) {
+			explicit_bzero(r->sr_sig, r->sr_slen);
+			free(r->sr_sig);
 		}
-		break;
-	case SLOT_ASYM_AUTH:
-		break;
-	default:
+	}
+	msg_end(cl, off);
+
+	VERIFY0(mutex_destroy(&b->sb_mtx));
+	free(b->sb_res);
+	free(b);
+}
+
+/*
+ * Re-arms a client's fd on clport once we've finished working on its request
+ * somewhere other than a reactor thread.
+ */
+static void
+client_resume(struct client_state *cl)
+{
+	cl->cs_events = POLLIN;
+	if (sshbuf_len(cl->cs_out) > 0)
+		cl->cs_events |= POLLOUT;
+	VERIFY0(port_associate(clport,
+	    PORT_SOURCE_FD, cl->cs_fd, cl->cs_events, cl));
+}
+
+static int try_process_message(struct client_state *);
+
+/*
+ * Processes every complete message sitting in the client's cs_in, stopping at
+ * the first one we have to defer to crypto_pool (responses have to go out in
+ * order, so the rest wait for that one to finish). Clients are allowed to
+ * pipeline requests, and may not send anything else until they get all of
+ * their responses.
+ */
+static int
+process_messages(struct client_state *cl)
+{
+	int rv;
+
+	do {
+		rv = try_process_message(cl);
+	} while (rv == ERR_NOERROR);
+	return (rv);
+}
+
+/*
+ * Writes as much of cs_out to the client as the socket will take right now,
+ * and sets POLLOUT in cs_events if there's some left over. Returns -1 if the
+ * connection is dead, but leaves it to the caller to close it.
+ */
+static int
+client_write(struct client_state *cl)
+{
+	ssize_t len;
+
+	if (sshbuf_len(cl->cs_out) == 0)
+		return (0);
+
+	len = write(cl->cs_fd, sshbuf_ptr(cl->cs_out), sshbuf_len(cl->cs_out));
+	if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+	    errno == EINTR)) {
+		cl->cs_events |= POLLOUT;
+		return (0);
+	}
+	if (len <= 0)
+		return (-1);
+	VERIFY0(sshbuf_consume(cl->cs_out, len));
+	if (sshbuf_len(cl->cs_out) > 0)
+		cl->cs_events |= POLLOUT;
+	return (0);
+}
+
+/*
+ * Like client_write(), but if the connection is dead, the client is closed
+ * and freed before we return -1.
+ */
+static int
+client_flush(struct client_state *cl)
+{
+	if (client_write(cl) != 0) {
+		close_client(cl);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Called just before we hand a request off to crypto_pool. Once we return
+ * ERR_DEFERRED, nobody sends anything to the client until the job is done, so
+ * any replies to requests pipelined ahead of this one go out now instead of
+ * waiting behind the signature. If the connection is dead we leave it alone:
+ * the flush after the job is done will find that out and close it.
+ */
+static void
+client_flush_deferred(struct client_state *cl)
+{
+	(void) client_write(cl);
+}
+
+static void
+crypto_event(port_event_t *ev)
+{
+	struct sign_job *job;
+	struct sign_batch *b;
+	struct sign_result *r;
+	struct client_state *cl;
+	boolean_t last;
+	size_t reqlen;
+	int rv;
+
+	VERIFY3S(ev->portev_source, ==, PORT_SOURCE_USER);
+	VERIFY3S(ev->portev_events, ==, EVENT_CRYPTO_JOB);
+
+	/*
+	 * Jobs coming back from being parked on a slot (see slot_hold()) are
+	 * sent to us directly, rather than going through the scheduler again.
+	 */
+	job = (struct sign_job *)ev->portev_user;
+	if (job == NULL) {
+		job = sched_next();
+		VERIFY0(bny_timer_next(job->sj_tms, "queue"));
+	} else {
+		VERIFY0(bny_timer_next(job->sj_tms, "unlock_wait"));
+	}
+	if (!slot_hold(job))
+		return;
+
+	cl = job->sj_client;
+	if ((b = job->sj_batch) != NULL) {
+		r = &b->sb_res[job->sj_idx];
+		r->sr_ok = (do_sign_job(job, &r->sr_sig, &r->sr_slen) == 0);
+		free_sign_job(job);
+
+		mutex_enter(&b->sb_mtx);
+		last = (--b->sb_pending == 0);
+		mutex_exit(&b->sb_mtx);
+		if (!last)
+			return;
+
+		reqlen = b->sb_reqlen;
+		finish_sign_batch(b);
+		consume_request(cl, reqlen);
+	} else {
+		run_sign_job(job);
+		consume_request(cl, job->sj_reqlen);
+		free_sign_job(job);
+	}
+
+	/*
+	 * The client may have pipelined more requests behind this one, so deal
+	 * with those before we send anything or hand it back to the reactors.
+	 */
+	rv = process_messages(cl);
+	if (rv == ERR_BADMSG || rv == ERR_DEFERRED)
+		return;
+	if (client_flush(cl) != 0)
+		return;
+	client_resume(cl);
+}
+
+/*
+ * Parses a sign request and works out which slot it's for. The actual
+ * signature is done later on a crypto_pool thread (see run_sign_job()).
+ */
+static int
+process_sign_request(struct client_state *cl, struct sshbuf *req,
+    size_t reqlen)
+{
+	struct token_slot *slot;
+	struct sign_job *job;
+	const u_char *blob, *data;
+	size_t blen, dlen;
+	uint32_t flags;
+
+	VERIFY0(sshbuf_get_string_direct(req, &blob, &blen));
+	VERIFY0(sshbuf_get_string_direct(req, &data, &dlen));
+	VERIFY0(sshbuf_get_u32(req, &flags));
+
+	slot = find_slot_by_blob(blob, blen);
+	if (slot == NULL || (slot->ts_type != SLOT_ASYM_CERT_SIGN &&
+	    slot->ts_type != SLOT_ASYM_AUTH)) {
 		send_status(cl, B_FALSE);
-		goto out;
+		return (ERR_NOERROR);
+	}
+	if (!sched_admit(cl->cs_flow)) {
+		send_status(cl, B_FALSE);
+		return (ERR_NOERROR);
 	}
 
-	a = slot->ts_agent;
-	mutex_enter(&a->as_mtx);
+	job = calloc(1, sizeof (struct sign_job));
+	VERIFY3P(job, !=, NULL);
+	job->sj_client = cl;
+	job->sj_slot = slot;
+	job->sj_data = data;
+	job->sj_dlen = dlen;
+	job->sj_flags = flags;
+	job->sj_reqlen = reqlen;
+
+	client_flush_deferred(cl);
+	sched_enqueue(job);
+	return (ERR_DEFERRED);
+}
+
+/*
+ * Parses a sign-batch@joyent.com request:
+ *
+ *	uint32		count
+ *	count times:
+ *		string	key blob
+ *		string	data
+ *		uint32	flags
+ *
+ * and hands a sign_job for each one we can do over to crypto_pool. We ask for
+ * each key involved to be unlocked once up front, so that the jobs don't each
+ * end up waiting on their own unlock.
+ */
+static int
+process_sign_batch(struct client_state *cl, struct sshbuf *req,
+    size_t reqlen)
+{
+	struct sign_batch *b;
+	struct sign_job **jobs;
+	struct token_slot *slot;
+	const u_char *blob, *data;
+	size_t blen, dlen;
+	uint32_t n, flags;
+	uint i, njobs = 0;
+
+	if (sshbuf_get_u32(req, &n) != 0 || n < 1 || n > SIGN_BATCH_MAX) {
+		send_status(cl, B_FALSE);
+		return (ERR_NOERROR);
+	}
+
+	b = calloc(1, sizeof (struct sign_batch));
+	VERIFY3P(b, !=, NULL);
+	b->sb_client = cl;
+	b->sb_n = n;
+	b->sb_reqlen = reqlen;
+	b->sb_res = calloc(n, sizeof (struct sign_result));
+	VERIFY3P(b->sb_res, !=, NULL);
+	VERIFY0(mutex_init(&b->sb_mtx, USYNC_THREAD | LOCK_ERRORCHECK, NULL));
+	jobs = calloc(n, sizeof (struct sign_job *));
+	VERIFY3P(jobs, !=, NULL);
+
+	for (i = 0; i < n; ++i) {
+		if (sshbuf_get_string_direct(req, &blob, &blen) != 0 ||
+		    sshbuf_get_string_direct(req, &data, &dlen) != 0 ||
+		    sshbuf_get_u32(req, &flags) != 0) {
+			goto bad;
+		}
+
+		slot = find_slot_by_blob(blob, blen);
+		if (slot == NULL || (slot->ts_type != SLOT_ASYM_CERT_SIGN &&
+		    slot->ts_type != SLOT_ASYM_AUTH)) {
+			continue;
+		}
+		if (!sched_admit(cl->cs_flow))
+			continue;
+
+		jobs[njobs] = calloc(1, sizeof (struct sign_job));
+		VERIFY3P(jobs[njobs], !=, NULL);
+		jobs[njobs]->sj_client = cl;
+		jobs[njobs]->sj_slot = slot;
+		jobs[njobs]->sj_data = data;
+		jobs[njobs]->sj_dlen = dlen;
+		jobs[njobs]->sj_flags = flags;
+		jobs[njobs]->sj_batch = b;
+		jobs[njobs]->sj_idx = i;
+		++njobs;
+	}
+	if (sshbuf_len(req) != 0)
+		goto bad;
+
+	bunyan_log(TRACE, "processing sign batch",
+	    "count", BNY_UINT, (uint)n,
+	    "jobs", BNY_UINT, njobs, NULL);
+
+	if (njobs == 0) {
+		finish_sign_batch(b);
+		free(jobs);
+		return (ERR_NOERROR);
+	}
 
 	/*
-	 * The shared pages are mapped PROT_NONE on our side until the data is
-	 * in use. While the refcount > 0, we change it to PROT_READ. Whichever
-	 * thread is responsible for decrementing the refcnt to 0 changes it
-	 * back to PROT_NONE.
-	 *
-	 * This way while the key material is waiting to be re-locked (during
-	 * the 5-sec timeout period), it's not trivially readable in this
-	 * process.
+	 * Like prefetch_slots(), count this as a use, so that the idle timer
+	 * doesn't lock the key again while the jobs wait their turn.
 	 */
-	if (++a->as_ref == 1) {
-		VERIFY0(mprotect((caddr_t)slot->ts_data, slot->ts_datasize,
-		    PROT_READ));
+	for (i = 0; i < njobs; ++i) {
+		slot = jobs[i]->sj_slot;
+		mutex_enter(&slot->ts_agent->as_mtx);
+		VERIFY0(clock_gettime(CLOCK_MONOTONIC,
+		    &slot->ts_agent->as_lastused));
+		request_unlock(slot);
+		mutex_exit(&slot->ts_agent->as_mtx);
+	}
+
+	b->sb_pending = njobs;
+	client_flush_deferred(cl);
+	for (i = 0; i < njobs; ++i)
+		sched_enqueue(jobs[i]);
+	free(jobs);
+	return (ERR_DEFERRED);
+
+bad:
+	for (i = 0; i < njobs; ++i)
+		free(jobs[i]);
+	free(jobs);
+	VERIFY0(mutex_destroy(&b->sb_mtx));
+	free(b->sb_res);
+	free(b);
+	send_status(cl, B_FALSE);
+	return (ERR_NOERROR);
+}
+
+static const char *
+req_type_name(uint8_t type)
+{
+	switch (type) {
+	case SSH2_AGENTC_SIGN_REQUEST:
+		return ("sign");
+	case SSH2_AGENTC_REQUEST_IDENTITIES:
+		return ("identities");
+	case SSH2_AGENTC_REQUEST_X509:
+		return ("x509");
+	case SSH_AGENTC_EXTENSION:
+		return ("extension");
+	default:
+		return (NULL);
 	}
+}
 
-	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &a->as_lastused));
+static void
+pool_stats(nvlist_t *nvl, struct worker_pool *wp)
+{
+	nvlist_t *pnvl;
+
+	VERIFY0(nvlist_alloc(&pnvl, NV_UNIQUE_NAME, 0));
+	mutex_enter(&wp->wp_mtx);
+	VERIFY0(nvlist_add_uint32(pnvl, "threads", wp->wp_nthreads));
+	VERIFY0(nvlist_add_uint32(pnvl, "busy_threads", wp->wp_nbusy));
+	VERIFY0(nvlist_add_uint64(pnvl, "events", wp->wp_events));
+	VERIFY0(nvlist_add_uint64(pnvl, "busy_ms", wp->wp_busy / 1000000));
+	mutex_exit(&wp->wp_mtx);
+	VERIFY0(nvlist_add_nvlist(nvl, wp->wp_name, pnvl));
+	nvlist_free(pnvl);
+}
 
-	/*
-	 * Wait until the key is unlocked. Send the message to the main thread
-	 * to request the unlock if necessary.
-	 */
-	while (a->as_state != AS_UNLOCKED) {
-		if (a->as_state == AS_LOCKED) {
-			a->as_cookie = next_cookie();
-			a->as_state = AS_UNLOCKING;
-			VERIFY0(port_send(mport, EVENT_WANT_UNLOCK, slot));
-			VERIFY0(cond_broadcast(&a->as_stchg));
+/*
+ * Handles the stats@joyent.com extension: replies with SSH_AGENT_SUCCESS and a
+ * string containing a JSON object like:
+ *
+ *	{ "uptime_sec": ..., "clients": ..., "accepted": ...,
+ *	  "max_clients": ..., "queued": ..., "throttled": ...,
+ *	  "requests": { "sign": ..., "identities": ..., ... },
+ *	  "slots": { "<name>": { "state": ..., "signs": ..., "sign_errors": ...,
+ *	      "unlocks": ..., "locks": ..., "renews": ..., "renew_errors": ...,
+ *	      "cert_age_sec": ... }, ... },
+ *	  "pools": { "reactor": { "threads": ..., "busy_threads": ...,
+ *	      "events": ..., "busy_ms": ... }, "crypto": { ... } },
+ *	  "histograms": { "sign.total": { "count": ..., "p50": ..., ... } } }
+ *
+ * Everything is a counter since the agent started, except the histograms
+ * (in usec), which cover the time since they were last logged (see
+ * bunyan_hist_tick()).
+ */
+static void
+process_stats(struct client_state *cl)
+{
+	static const char *state_names[] = {
+		[AS_UNLOCKED] = "unlocked",
+		[AS_LOCKING] = "locking",
+		[AS_LOCKED] = "locked",
+		[AS_UNLOCKING] = "unlocking"
+	};
+	nvlist_t *nvl, *rnvl, *snvl, *pnvl, *hnvl;
+	struct token_slot *slot;
+	struct agent_slot *as;
+	struct timespec now, delta;
+	const char *tname;
+	char buf[16];
+	char *json;
+	size_t len, off;
+	uint i;
+
+	VERIFY0(nvlist_alloc(&nvl, NV_UNIQUE_NAME, 0));
+	VERIFY0(nvlist_add_uint64(nvl, "uptime_sec",
+	    (mono_ms() - start_ms) / 1000));
+	VERIFY0(nvlist_add_uint64(nvl, "clients", stats.st_clients));
+	VERIFY0(nvlist_add_uint64(nvl, "accepted", stats.st_accepted));
+	VERIFY0(nvlist_add_uint32(nvl, "max_clients", max_clients));
+	VERIFY0(nvlist_add_uint64(nvl, "queued", stats.st_queued));
+	VERIFY0(nvlist_add_uint64(nvl, "sign_jobs", stats.st_signs));
+	VERIFY0(nvlist_add_uint64(nvl, "throttled", stats.st_throttled));
+
+	VERIFY0(nvlist_alloc(&rnvl, NV_UNIQUE_NAME, 0));
+	for (i = 0; i < 256; ++i) {
+		if (stats.st_reqs[i] == 0)
+			continue;
+		if ((tname = req_type_name(i)) == NULL) {
+			(void) snprintf(buf, sizeof (buf), "%u", i);
+			tname = buf;
 		}
-		do {
-			rv = cond_wait(&a->as_stchg, &a->as_mtx);
-		} while (rv == EINTR);
-		VERIFY0(rv);
+		VERIFY0(nvlist_add_uint64(rnvl, tname, stats.st_reqs[i]));
 	}
-	VERIFY3U(a->as_state, ==, AS_UNLOCKED);
-	VERIFY3U(slot->ts_data->tsd_len, >, 0);
+	VERIFY0(nvlist_add_nvlist(nvl, "requests", rnvl));
+	nvlist_free(rnvl);
 
-	mutex_exit(&a->as_mtx);
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &now));
+	VERIFY0(nvlist_alloc(&snvl, NV_UNIQUE_NAME, 0));
+	for (slot = token_slots; slot != NULL; slot = slot->ts_next) {
+		as = slot->ts_agent;
+		VERIFY0(nvlist_alloc(&pnvl, NV_UNIQUE_NAME, 0));
+		mutex_enter(&as->as_mtx);
+		VERIFY0(nvlist_add_string(pnvl, "state",
+		    state_names[as->as_state]));
+		VERIFY0(nvlist_add_uint64(pnvl, "signs", as->as_signs));
+		VERIFY0(nvlist_add_uint64(pnvl, "sign_errors",
+		    as->as_sign_errors));
+		VERIFY0(nvlist_add_uint64(pnvl, "unlocks", as->as_unlocks));
+		VERIFY0(nvlist_add_uint64(pnvl, "locks", as->as_locks));
+		VERIFY0(nvlist_add_uint64(pnvl, "renews", as->as_renews));
+		VERIFY0(nvlist_add_uint64(pnvl, "renew_errors",
+		    as->as_renew_errors));
+		if (as->as_renews > 0) {
+			tspec_subtract(&delta, &now, &as->as_renew);
+			VERIFY0(nvlist_add_uint64(pnvl, "cert_age_sec",
+			    delta.tv_sec));
+		}
+		mutex_exit(&as->as_mtx);
+		VERIFY0(nvlist_add_nvlist(snvl, slot->ts_name, pnvl));
+		nvlist_free(pnvl);
+	}
+	VERIFY0(nvlist_add_nvlist(nvl, "slots", snvl));
+	nvlist_free(snvl);
+
+	VERIFY0(nvlist_alloc(&pnvl, NV_UNIQUE_NAME, 0));
+	pool_stats(pnvl, &reactor_pool);
+	pool_stats(pnvl, &crypto_pool);
+	VERIFY0(nvlist_add_nvlist(nvl, "pools", pnvl));
+	nvlist_free(pnvl);
+
+	VERIFY0(nvlist_alloc(&hnvl, NV_UNIQUE_NAME, 0));
+	bunyan_hist_nvl(hnvl);
+	VERIFY0(nvlist_add_nvlist(nvl, "histograms", hnvl));
+	nvlist_free(hnvl);
+
+	json = bunyan_nvl_json(nvl, &len);
+	nvlist_free(nvl);
+
+	off = msg_begin(cl, SSH_AGENT_SUCCESS);
+	VERIFY0(sshbuf_put_string(cl->cs_out, json, len));
+	msg_end(cl, off);
+	free(json);
+}
 
-	kbuf = sshbuf_from((const void *)slot->ts_data->tsd_data,
-	    slot->ts_data->tsd_len);
-	VERIFY3P(kbuf, !=, NULL);
-	VERIFY0(sshkey_private_deserialize(kbuf, &privkey));
-	sshbuf_free(kbuf);
+/*
+ * Handles SSH_AGENTC_EXTENSION. We support the standard "query" extension
+ * (which lists the ones we support), our own sign-batch@joyent.com, and
+ * stats@joyent.com.
+ */
+static int
+process_extension(struct client_state *cl, struct sshbuf *req, size_t reqlen)
+{
+	const u_char *name;
+	size_t nlen, off;
 
-	/* We're done with the shared memory now, so we can release it. */
-	mutex_enter(&a->as_mtx);
-	if (--a->as_ref == 0) {
-		VERIFY0(mprotect((caddr_t)slot->ts_data, slot->ts_datasize,
-		    PROT_NONE));
+	if (sshbuf_get_string_direct(req, &name, &nlen) != 0) {
+		send_status(cl, B_FALSE);
+		return (ERR_NOERROR);
 	}
-	mutex_exit(&a->as_mtx);
 
-	if (privkey->type == KEY_RSA) {
-		if (flags & SSH_AGENT_RSA_SHA2_256)
-			alg = "rsa-sha2-256";
-		else if (flags & SSH_AGENT_RSA_SHA2_512)
-			alg = "rsa-sha2-512";
+	if (nlen == strlen("query") && bcmp(name, "query", nlen) == 0) {
+		off = msg_begin(cl, SSH_AGENT_SUCCESS);
+		VERIFY0(sshbuf_put_cstring(cl->cs_out, "query"));
+		VERIFY0(sshbuf_put_cstring(cl->cs_out, EXT_SIGN_BATCH));
+		VERIFY0(sshbuf_put_cstring(cl->cs_out, EXT_STATS));
+		msg_end(cl, off);
+		return (ERR_NOERROR);
+	}
+	if (nlen == strlen(EXT_SIGN_BATCH) &&
+	    bcmp(name, EXT_SIGN_BATCH, nlen) == 0) {
+		return (process_sign_batch(cl, req, reqlen));
+	}
+	if (nlen == strlen(EXT_STATS) && bcmp(name, EXT_STATS, nlen) == 0) {
+		process_stats(cl);
+		return (ERR_NOERROR);
 	}
-	VERIFY0(sshkey_sign(privkey, &sig, &slen, data, dlen, alg, compat));
-	sshkey_free(privkey);
-
-	msg = sshbuf_new();
-	VERIFY3P(msg, !=, NULL);
-
-	VERIFY0(sshbuf_put_u8(msg, SSH2_AGENT_SIGN_RESPONSE));
-	VERIFY0(sshbuf_put_string(msg, sig, slen));
-	VERIFY0(sshbuf_put_stringb(cl->cs_out, msg));
 
-	sshbuf_free(msg);
-out:
-	free(blob);
-	free(data);
-	sshkey_free(key);
-	if (sig != NULL)
-		explicit_bzero(sig, slen);
-	free(sig);
+	bunyan_log(DEBUG, "unsupported extension", NULL);
+	send_status(cl, B_FALSE);
+	return (ERR_NOERROR);
 }
 
 static int
 try_process_message(struct client_state *cl)
 {
+	struct sshbuf *req;
 	const uint8_t *cp;
 	size_t len;
-	int rv;
+	int rv = ERR_NOERROR;
 	uint8_t type;
 
 	if (sshbuf_len(cl->cs_in) < 5)
 		return (ERR_INCOMPLETE);
 
 	cp = sshbuf_ptr(cl->cs_in);
-	len = cp[0] << 24 | cp[1] << 16 | cp[2] << 8 | cp[3];
-	if (len > 256 * 1024) {
+	len = PEEK_U32(cp);
+	if (len < 1 || len > 256 * 1024) {
 		close_client(cl);
 		return (ERR_BADMSG);
 	}
@@ -907,37 +2621,44 @@ try_process_message(struct client_state *cl)
 	if (sshbuf_len(cl->cs_in) < len + 4)
 		return (ERR_INCOMPLETE);
 
-	sshbuf_reset(cl->cs_req);
-	rv = sshbuf_get_stringb(cl->cs_in, cl->cs_req);
-	VERIFY0(rv);
-	rv = sshbuf_get_u8(cl->cs_req, &type);
-	VERIFY0(rv);
+	/*
+	 * We parse the request in place: req is just a read-only view of the
+	 * frame sitting in cs_in, which we consume once we're done with it.
+	 */
+	req = sshbuf_from(cp + 4, len);
+	VERIFY3P(req, !=, NULL);
+	VERIFY0(sshbuf_get_u8(req, &type));
 
-	bunyan_set(
+	bunyan_thread_set(
 	    "client_pid", BNY_INT, (int)ucred_getpid(cl->cs_ucred),
 	    "client_euid", BNY_INT, (int)ucred_geteuid(cl->cs_ucred),
 	    "type", BNY_INT, (int)type,
 	    NULL);
 
 	bunyan_log(TRACE, "processing message from client", NULL);
+	atomic_inc_64(&stats.st_reqs[type]);
+	fr_record(FR_CLIENT_REQ, cl->cs_fd, type, ucred_getpid(cl->cs_ucred),
+	    0);
 
 	switch (type) {
 	case SSH2_AGENTC_SIGN_REQUEST:
-		process_sign_request(cl);
+		rv = process_sign_request(cl, req, len + 4);
 		break;
 	case SSH2_AGENTC_REQUEST_IDENTITIES:
+		prefetch_slots(SLOT_ASYM_AUTH);
 		process_request_identities(cl);
 		break;
 	case SSH2_AGENTC_REQUEST_X509:
-		process_request_x509(cl);
+		process_request_x509(cl, req);
+		break;
+	case SSH_AGENTC_EXTENSION:
+		rv = process_extension(cl, req, len + 4);
 		break;
 	case SSH_AGENTC_LOCK:
 	case SSH_AGENTC_UNLOCK:
-		sshbuf_reset(cl->cs_req);
 		send_status(cl, B_FALSE);
 		break;
 	case SSH_AGENTC_REMOVE_ALL_RSA_IDENTITIES:
-		sshbuf_reset(cl->cs_req);
 		send_status(cl, B_FALSE);
 		break;
 	case SSH2_AGENTC_ADD_IDENTITY:
@@ -945,15 +2666,22 @@ try_process_message(struct client_state *cl)
 	case SSH2_AGENTC_REMOVE_IDENTITY:
 	case SSH2_AGENTC_REMOVE_ALL_IDENTITIES:
 		bunyan_log(DEBUG, "unsupported operation", NULL);
-		sshbuf_reset(cl->cs_req);
 		send_status(cl, B_FALSE);
 		break;
 	default:
 		bunyan_log(ERROR, "client sent unknown message type", NULL);
-		sshbuf_reset(cl->cs_req);
 		send_status(cl, B_FALSE);
 	}
-	return (0);
+	sshbuf_free(req);
+
+	/*
+	 * A deferred sign job is still using the request's data, so its frame
+	 * stays in cs_in until crypto_event() is finished with it.
+	 */
+	if (rv != ERR_DEFERRED)
+		consume_request(cl, len + 4);
+	bunyan_thread_clear();
+	return (rv);
 }
 
 struct acceptor_args {
@@ -961,17 +2689,89 @@ struct acceptor_args {
 	int a_listensock;
 };
 
+/*
+ * Sets up a client_state for a newly accepted connection and hands it to the
+ * reactors. Returns 0 if the client was taken on.
+ */
+static int
+accept_client(int sockfd, const struct sockaddr_un *raddr, size_t raddrlen,
+    zoneid_t zid)
+{
+	struct client_state *cl;
+	struct bunyan_timers *tms;
+	zoneid_t theirzid;
+
+	tms = bny_timers_new();
+	VERIFY3P(tms, !=, NULL);
+	VERIFY0(bny_timer_begin(tms));
+
+	/* We write replies optimistically, so this mustn't block. */
+	VERIFY0(fcntl(sockfd, F_SETFL,
+	    fcntl(sockfd, F_GETFL) | O_NONBLOCK));
+
+	cl = client_get();
+	bcopy(raddr, &cl->cs_peer, raddrlen);
+	/* If cs_ucred came from the pool, this re-uses it. */
+	if (getpeerucred(sockfd, &cl->cs_ucred) != 0) {
+		bunyan_log(ERROR,
+		    "failed to get peer ucred",
+		    "errno", BNY_INT, errno, NULL);
+		client_put(cl);
+		VERIFY0(close(sockfd));
+		bny_timers_free(tms);
+		return (-1);
+	}
+	theirzid = ucred_getzoneid(cl->cs_ucred);
+	if (theirzid != zid) {
+		bunyan_log(ERROR,
+		    "zoneid of client doesn't match server",
+		    "client_zoneid", BNY_INT, theirzid, NULL);
+		client_put(cl);
+		VERIFY0(close(sockfd));
+		bny_timers_free(tms);
+		return (-1);
+	}
+	VERIFY0(bny_timer_next(tms, "ucred"));
+	cl->cs_zid = zid;
+	cl->cs_fd = sockfd;
+	cl->cs_flow = sched_flow_get(cl->cs_ucred);
+	atomic_inc_64(&stats.st_clients);
+	atomic_inc_64(&stats.st_accepted);
+	cl->cs_events = POLLIN;
+
+	mutex_enter(&clients_mtx);
+	if (clients != NULL)
+		clients->cs_prev = cl;
+	cl->cs_next = clients;
+	clients = cl;
+	++nclients;
+	mutex_exit(&clients_mtx);
+
+	SOFTTOKEN_CLIENT_ACCEPT(sockfd, (int)ucred_getpid(cl->cs_ucred),
+	    (int)ucred_geteuid(cl->cs_ucred));
+	fr_record(FR_CLIENT_ACCEPT, sockfd, ucred_getpid(cl->cs_ucred),
+	    ucred_geteuid(cl->cs_ucred), 0);
+	VERIFY0(port_associate(clport,
+	    PORT_SOURCE_FD, cl->cs_fd, cl->cs_events, cl));
+
+	VERIFY0(bny_timer_next(tms, "setup"));
+	bny_timers_record(tms, "accept");
+	bny_timers_free(tms);
+	return (0);
+}
+
 static void *
 accept_reactor(void *arg)
 {
 	int rv;
 	int sockfd, listensock;
-	struct client_state *cl;
 	struct sockaddr_un raddr;
 	size_t raddrlen;
 	port_event_t ev;
 	struct acceptor_args *args;
-	zoneid_t zid, theirzid;
+	zoneid_t zid;
+	uint accepted;
+	boolean_t paused;
 
 	VERIFY(arg != NULL);
 	args = (struct acceptor_args *)arg;
@@ -998,152 +2798,384 @@ accept_reactor(void *arg)
 		VERIFY3S(ev.portev_source, ==, PORT_SOURCE_FD);
 		VERIFY3S(ev.portev_object, ==, listensock);
 
-		/* A new connection has arrived. */
-		raddrlen = sizeof (raddr);
-		bzero(&raddr, sizeof (raddr));
-		sockfd = accept(listensock, (struct sockaddr *)&raddr,
-		    &raddrlen);
-		assert(sockfd > 0);
+		/*
+		 * New connections have arrived. Connections tend to turn up
+		 * in bursts, so take everything that's waiting (the listen
+		 * socket is non-blocking), unless we hit the client limit.
+		 */
+		accepted = 0;
+		paused = B_FALSE;
+		while (1) {
+			mutex_enter(&clients_mtx);
+			if (nclients >= max_clients)
+				paused = listen_paused = B_TRUE;
+			mutex_exit(&clients_mtx);
+			if (paused) {
+				bunyan_log(WARN, "client limit reached, "
+				    "not accepting new clients",
+				    "max_clients", BNY_UINT, max_clients, NULL);
+				break;
+			}
 
-		cl = calloc(1, sizeof (struct client_state));
-		assert(cl != NULL);
-		bcopy(&raddr, &cl->cs_peer, raddrlen);
-		if (getpeerucred(sockfd, &cl->cs_ucred) != 0) {
-			bunyan_log(ERROR,
-			    "failed to get peer ucred",
-			    "errno", BNY_INT, errno, NULL);
-			free(cl);
-			assert(close(sockfd) == 0);
-			goto rearmlisten;
-		}
-		theirzid = ucred_getzoneid(cl->cs_ucred);
-		if (theirzid != zid) {
-			bunyan_log(ERROR,
-			    "zoneid of client doesn't match server",
-			    "client_zoneid", BNY_INT, theirzid, NULL);
-			free(cl);
-			VERIFY0(close(sockfd));
-			goto rearmlisten;
+			raddrlen = sizeof (raddr);
+			bzero(&raddr, sizeof (raddr));
+			sockfd = accept(listensock, (struct sockaddr *)&raddr,
+			    &raddrlen);
+			if (sockfd == -1 && (errno == EINTR ||
+			    errno == ECONNABORTED)) {
+				continue;
+			}
+			if (sockfd == -1 && (errno == EAGAIN ||
+			    errno == EWOULDBLOCK)) {
+				break;
+			}
+			if (sockfd == -1 && (errno == EMFILE ||
+			    errno == ENFILE)) {
+				/*
+				 * Out of fds: wait for a client to close (or
+				 * for the main loop's next tick, if there
+				 * aren't any) before we try again, rather
+				 * than spin.
+				 */
+				bunyan_log(WARN, "out of fds, "
+				    "not accepting new clients", NULL);
+				mutex_enter(&clients_mtx);
+				paused = listen_paused = B_TRUE;
+				mutex_exit(&clients_mtx);
+				break;
+			}
+			VERIFY3S(sockfd, >=, 0);
+
+			if (accept_client(sockfd, &raddr, raddrlen, zid) == 0)
+				++accepted;
 		}
-		cl->cs_zid = zid;
-		cl->cs_fd = sockfd;
-		cl->cs_in = sshbuf_new();
-		assert(cl->cs_in != NULL);
-		cl->cs_out = sshbuf_new();
-		assert(cl->cs_in != NULL);
-		cl->cs_req = sshbuf_new();
-		assert(cl->cs_in != NULL);
-		cl->cs_events = POLLIN;
+
+		if (accepted > 0)
+			prefetch_slots(SLOT_ASYM_AUTH);
 
 		mutex_enter(&clients_mtx);
-		if (clients != NULL)
-			clients->cs_prev = cl;
-		cl->cs_next = clients;
-		clients = cl;
+		if (!listen_paused) {
+			VERIFY0(port_associate(acport,
+			    PORT_SOURCE_FD, listensock, POLLIN, NULL));
+		}
 		mutex_exit(&clients_mtx);
+	}
+}
 
-		VERIFY0(port_associate(clport,
-		    PORT_SOURCE_FD, cl->cs_fd, cl->cs_events, cl));
-rearmlisten:
-		VERIFY0(port_associate(acport,
-		    PORT_SOURCE_FD, listensock, POLLIN, NULL));
+static void
+client_event(port_event_t *evp)
+{
+	port_event_t ev = *evp;
+	struct client_state *cl;
+	ssize_t len;
+	u_char *buf;
+	int rv;
+
+	if (ev.portev_source == PORT_SOURCE_USER) {
+		VERIFY0(ev.portev_events);
+		return;
+	}
+
+	cl = (struct client_state *)ev.portev_user;
+	assert(cl != NULL);
+	assert(cl->cs_fd == ev.portev_object);
+	cl->cs_events = POLLIN;
+
+	if ((ev.portev_events & POLLOUT) != 0) {
+		if (client_flush(cl) != 0)
+			return;
+	}
+
+	if ((ev.portev_events & POLLIN) != 0) {
+		/*
+		 * Read straight into the end of cs_in, then give back whatever
+		 * part of the reservation we didn't use.
+		 */
+		VERIFY0(sshbuf_reserve(cl->cs_in, CLIENT_READ_SIZE, &buf));
+		len = read(cl->cs_fd, buf, CLIENT_READ_SIZE);
+		VERIFY0(sshbuf_consume_end(cl->cs_in,
+		    CLIENT_READ_SIZE - (len > 0 ? len : 0)));
+		if (len == -1 && (errno == EAGAIN ||
+		    errno == EWOULDBLOCK || errno == EINTR)) {
+			goto rearm;
+		}
+		if (len <= 0) {
+			close_client(cl);
+			return;
+		}
+		/*
+		 * Handle everything the client has sent us so far, and then
+		 * send all of the responses in one write.
+		 */
+		rv = process_messages(cl);
+		if (rv == ERR_BADMSG || rv == ERR_DEFERRED)
+			return;
+		if (client_flush(cl) != 0)
+			return;
 	}
+
+rearm:
+	VERIFY0(port_associate(clport,
+	    PORT_SOURCE_FD, cl->cs_fd, cl->cs_events, cl));
 }
 
+static void pool_spawn(struct worker_pool *);
+
+/*
+ * The main loop of a thread in a worker_pool.
+ *
+ * When a thread picks up an event and finds that it has made every thread in
+ * the pool busy, it checks how many more events are queued up on the port
+ * behind it. If there are any, it starts another thread to deal with them
+ * (up to wp_max). Threads that time out in port_get() with nothing to do exit,
+ * as long as that leaves at least wp_min of them.
+ */
 static void *
-client_reactor(void *arg)
+pool_worker(void *arg)
 {
-	port_event_t ev;
-	struct client_state *cl;
-	size_t len;
-	char *buf = calloc(1, 4096);
-	int buflen = 4096;
+	struct worker_pool *wp = (struct worker_pool *)arg;
+	port_event_t ev, dummy;
+	struct timespec tout;
+	uint_t depth;
+	hrtime_t t0, t1;
 	int rv;
-	assert(buf != NULL);
 
 	while (1) {
-		rv = port_get(clport, &ev, NULL);
+		bzero(&tout, sizeof (tout));
+		tout.tv_sec = POOL_IDLE_SEC;
+		rv = port_get(wp->wp_port, &ev, &tout);
 		if (rv == -1 && errno == EINTR) {
 			continue;
-		} else {
-			assert(rv == 0);
-		}
-
-		if (ev.portev_source == PORT_SOURCE_USER) {
-			if (ev.portev_events == EVENT_STOP) {
+		} else if (rv == -1 && errno == ETIME) {
+			mutex_enter(&wp->wp_mtx);
+			if (wp->wp_nthreads > wp->wp_min) {
+				--wp->wp_nthreads;
+				VERIFY0(cond_broadcast(&wp->wp_chg));
+				mutex_exit(&wp->wp_mtx);
 				return (NULL);
 			}
-			VERIFY0(ev.portev_events);
+			mutex_exit(&wp->wp_mtx);
 			continue;
+		} else {
+			VERIFY0(rv);
 		}
 
-		cl = (struct client_state *)ev.portev_user;
-		assert(cl != NULL);
-		assert(cl->cs_fd == ev.portev_object);
-		cl->cs_events = POLLIN;
-
-		if ((ev.portev_events & POLLOUT) != 0 &&
-		    sshbuf_len(cl->cs_out) > 0) {
-			len = write(cl->cs_fd,
-			    sshbuf_ptr(cl->cs_out),
-			    sshbuf_len(cl->cs_out));
-			if (len == -1 && (errno == EAGAIN ||
-			    errno == EWOULDBLOCK || errno == EINTR)) {
-				cl->cs_events |= POLLOUT;
-				goto rearm;
-			}
-			if (len <= 0) {
-				close_client(cl);
-				continue;
-			}
-			VERIFY0(sshbuf_consume(cl->cs_out, len));
-			if (sshbuf_len(cl->cs_out) > 0)
-				cl->cs_events |= POLLOUT;
+		if (ev.portev_source == PORT_SOURCE_USER &&
+		    ev.portev_events == EVENT_STOP) {
+			mutex_enter(&wp->wp_mtx);
+			--wp->wp_nthreads;
+			VERIFY0(cond_broadcast(&wp->wp_chg));
+			mutex_exit(&wp->wp_mtx);
+			return (NULL);
 		}
 
-		if ((ev.portev_events & POLLIN) != 0) {
-			len = read(cl->cs_fd, buf, buflen);
-			if (len == -1 && (errno == EAGAIN ||
-			    errno == EWOULDBLOCK || errno == EINTR)) {
-				goto rearm;
-			}
-			if (len <= 0) {
-				close_client(cl);
-				continue;
-			}
-			VERIFY0(sshbuf_put(cl->cs_in, buf, len));
-			explicit_bzero(buf, len);
-			rv = try_process_message(cl);
-			if (rv == ERR_BADMSG)
-				continue;
-			if (sshbuf_len(cl->cs_out) > 0)
-				cl->cs_events |= POLLOUT;
+		mutex_enter(&wp->wp_mtx);
+		if (++wp->wp_nbusy >= wp->wp_nthreads &&
+		    wp->wp_nthreads < wp->wp_max && !wp->wp_stopping) {
+			/* With max = 0, this just counts pending events. */
+			depth = 0;
+			VERIFY0(port_getn(wp->wp_port, &dummy, 0, &depth,
+			    NULL));
+			if (depth > 0)
+				pool_spawn(wp);
 		}
+		mutex_exit(&wp->wp_mtx);
 
-rearm:
-		VERIFY0(port_associate(clport,
-		    PORT_SOURCE_FD, cl->cs_fd, cl->cs_events, cl));
+		t0 = gethrtime();
+		wp->wp_handler(&ev);
+		t1 = gethrtime();
+
+		mutex_enter(&wp->wp_mtx);
+		--wp->wp_nbusy;
+		++wp->wp_events;
+		wp->wp_busy += t1 - t0;
+		mutex_exit(&wp->wp_mtx);
 	}
 
 	return (NULL);
 }
 
+/* Must be called with wp_mtx held. */
+static void
+pool_spawn(struct worker_pool *wp)
+{
+	thread_t tid;
+
+	VERIFY0(thr_create(NULL, 0, pool_worker, wp, THR_DETACHED, &tid));
+	++wp->wp_nthreads;
+	bunyan_log(TRACE, "worker pool grew",
+	    "pool", BNY_STRING, wp->wp_name,
+	    "threads", BNY_UINT, wp->wp_nthreads, NULL);
+}
+
+static void
+pool_init(struct worker_pool *wp, const char *name, int port,
+    void (*handler)(port_event_t *), uint min, uint max)
+{
+	uint i;
+
+	bzero(wp, sizeof (*wp));
+	wp->wp_name = name;
+	wp->wp_port = port;
+	wp->wp_handler = handler;
+	if (max < 1)
+		max = 1;
+	if (min > max)
+		min = max;
+	wp->wp_min = min;
+	wp->wp_max = max;
+	VERIFY0(mutex_init(&wp->wp_mtx, USYNC_THREAD | LOCK_ERRORCHECK,
+	    NULL));
+	VERIFY0(cond_init(&wp->wp_chg, USYNC_THREAD, 0));
+
+	mutex_enter(&wp->wp_mtx);
+	for (i = 0; i < min; ++i)
+		pool_spawn(wp);
+	mutex_exit(&wp->wp_mtx);
+
+	bunyan_log(DEBUG, "started worker pool",
+	    "pool", BNY_STRING, name,
+	    "min_threads", BNY_UINT, min,
+	    "max_threads", BNY_UINT, max, NULL);
+}
+
+/*
+ * Stops all the threads in a pool and waits for them to exit. Any events still
+ * queued on the port behind the EVENT_STOPs are left there.
+ */
+static void
+pool_stop(struct worker_pool *wp)
+{
+	uint i, n;
+	int rv;
+
+	mutex_enter(&wp->wp_mtx);
+	wp->wp_stopping = B_TRUE;
+	n = wp->wp_nthreads;
+	mutex_exit(&wp->wp_mtx);
+
+	for (i = 0; i < n; ++i)
+		VERIFY0(port_send(wp->wp_port, EVENT_STOP, NULL));
+
+	mutex_enter(&wp->wp_mtx);
+	while (wp->wp_nthreads > 0) {
+		rv = cond_wait(&wp->wp_chg, &wp->wp_mtx);
+		VERIFY(rv == 0 || rv == EINTR);
+	}
+	mutex_exit(&wp->wp_mtx);
+}
+
+/* The most events the main thread takes from its port in one go. */
+#define	MAX_MAIN_EVENTS	16
+
+/*
+ * Puts a request for the supervisor on the submission ring. The caller rings
+ * the doorbell once it's done submitting. We never have more than two
+ * requests in flight per slot, so the ring can't be full.
+ */
+static void
+submit_req(const struct ctl_req *req)
+{
+	VERIFY0(ctl_ring_put(&token_ctl_rings->cr_sq, req));
+}
+
+/*
+ * Handles one reply from the supervisor off the completion ring. The ID tells
+ * us the slot directly, and whether it was for a lock/unlock or a renewal.
+ */
+static void
+handle_reply(const struct ctl_req *rep)
+{
+	struct token_slot *slot;
+	struct agent_slot *as;
+	struct sign_job *parked = NULL, *job;
+
+	slot = slots_by_id[rep->cr_id & 0xff];
+	if (slot == NULL) {
+		bunyan_log(ERROR, "supervisor replied for unknown slot",
+		    "req_id", BNY_UINT, rep->cr_id, NULL);
+		return;
+	}
+	as = slot->ts_agent;
+
+	mutex_enter(&as->as_mtx);
+	if (as->as_reqid == rep->cr_id) {
+		as->as_reqid = 0;
+		VERIFY3U(rep->cr_status, ==, STATUS_OK);
+		switch (as->as_state) {
+		case AS_UNLOCKING:
+			fr_record(FR_SLOT_STATE, slot->ts_id, AS_UNLOCKING,
+			    AS_UNLOCKED, 0);
+			as->as_state = AS_UNLOCKED;
+			++as->as_unlocks;
+			SOFTTOKEN_UNLOCK_DONE((char *)slot->ts_name,
+			    rep->cr_id);
+			parked = as->as_parked;
+			as->as_parked = NULL;
+			as->as_parked_tail = NULL;
+			break;
+		case AS_LOCKING:
+			fr_record(FR_SLOT_STATE, slot->ts_id, AS_LOCKING,
+			    AS_LOCKED, 0);
+			as->as_state = AS_LOCKED;
+			++as->as_locks;
+			SOFTTOKEN_LOCK_DONE((char *)slot->ts_name, rep->cr_id);
+			/* Jobs that turned up while we were locking it. */
+			if (as->as_parked != NULL)
+				request_unlock(slot);
+			break;
+		default:
+			assert(0);
+		}
+	} else if (as->as_renew_id == rep->cr_id) {
+		as->as_renew_id = 0;
+		SOFTTOKEN_RENEW_DONE((char *)slot->ts_name, rep->cr_id,
+		    (rep->cr_status == STATUS_OK) ? 0 : -1);
+		if (rep->cr_status == STATUS_OK) {
+			VERIFY0(clock_gettime(CLOCK_MONOTONIC,
+			    &as->as_renew));
+			++as->as_renews;
+		} else {
+			++as->as_renew_errors;
+		}
+	} else {
+		bunyan_log(WARN, "supervisor replied to unknown request",
+		    "req_id", BNY_UINT, rep->cr_id,
+		    "slot_name", BNY_STRING, slot->ts_name, NULL);
+	}
+	mutex_exit(&as->as_mtx);
+
+	while ((job = parked) != NULL) {
+		parked = job->sj_next;
+		job->sj_next = NULL;
+		VERIFY0(port_send(cryport, EVENT_CRYPTO_JOB, job));
+	}
+}
+
 void
 agent_main(zoneid_t zid, nvlist_t *zinfo, int listensock, int ctlfd)
 {
 	int portfd;
 	struct ctl_cmd cmd;
+	struct ctl_req req;
 	enum ctl_cmd_type cmdtype;
+	port_event_t evs[MAX_MAIN_EVENTS];
 	port_event_t ev;
-	int i, rv;
+	uint_t nget, i;
+	int rv;
 	struct token_slot *slot;
 	struct agent_slot *as;
-	struct timespec tout, now, delta;
+	struct timespec tout, now, delta, last_stats, last_relisten;
 	priv_set_t *pset;
-	boolean_t was_renew;
+	boolean_t submitted;
 	struct acceptor_args aa;
+	const char *tmp;
+	uint minthr, maxthr;
+	long ncpu;
 
 	bunyan_set_name("agent");
+	fr_set_name("agent");
+	start_ms = mono_ms();
 
 	unshare_code();
 
@@ -1155,7 +3187,14 @@ agent_main(zoneid_t zid, nvlist_t *zinfo, int listensock, int ctlfd)
 	VERIFY0(mlockall(MCL_CURRENT | MCL_FUTURE));
 
 	/* Start listening on our UNIX socket inside the zone. */
-	VERIFY0(listen(listensock, 10));
+	VERIFY0(listen(listensock,
+	    env_uint("TOKEN_LISTEN_BACKLOG", DEFAULT_LISTEN_BACKLOG)));
+	VERIFY0(fcntl(listensock, F_SETFL,
+	    fcntl(listensock, F_GETFL) | O_NONBLOCK));
+	listen_fd = listensock;
+	max_clients = env_uint("TOKEN_MAX_CLIENTS", DEFAULT_MAX_CLIENTS);
+	if (max_clients < 1)
+		max_clients = 1;
 
 	/*
 	 * We use this port for events on this thread: messages from parent
@@ -1173,6 +3212,10 @@ agent_main(zoneid_t zid, nvlist_t *zinfo, int listensock, int ctlfd)
 	clport = port_create();
 	assert(clport > 0);
 
+	/* And this one is the queue of signing work for crypto_pool. */
+	cryport = port_create();
+	VERIFY(cryport > 0);
+
 	/* This port is for accepting new sockets. */
 	acport = port_create();
 	VERIFY(acport > 0);
@@ -1217,6 +3260,13 @@ agent_main(zoneid_t zid, nvlist_t *zinfo, int listensock, int ctlfd)
 		    (char **)&zone_owner));
 		VERIFY0(nvlist_lookup_nvlist(zinfo, "tags", &zone_tags));
 	}
+	make_cert_templates(zid);
+
+	tmp = getenv("TOKEN_PREFETCH");
+	if (tmp != NULL && (strcasecmp(tmp, "yes") == 0 ||
+	    strcasecmp(tmp, "true") == 0 || strcmp(tmp, "1") == 0)) {
+		prefetch_unlock = B_TRUE;
+	}
 
 	/*
 	 * This protects the list of client state structs (one per incoming UDS
@@ -1225,6 +3275,19 @@ agent_main(zoneid_t zid, nvlist_t *zinfo, int listensock, int ctlfd)
 	VERIFY0(mutex_init(&clients_mtx, USYNC_THREAD | LOCK_ERRORCHECK,
 	    NULL));
 
+	/* This one protects the sign job scheduler (see sched_next()). */
+	VERIFY0(mutex_init(&sched_mtx, USYNC_THREAD | LOCK_ERRORCHECK, NULL));
+	sched_rate = env_uint("TOKEN_CLIENT_RATE", 0);
+	sched_burst = env_uint("TOKEN_CLIENT_BURST", sched_rate);
+	if (sched_rate > 0 && sched_burst < 1)
+		sched_burst = 1;
+
+	/* And this one the prebuilt identities answer. */
+	VERIFY0(mutex_init(&ids_mtx, USYNC_THREAD | LOCK_ERRORCHECK, NULL));
+	ids_msg = sshbuf_new();
+	VERIFY3P(ids_msg, !=, NULL);
+	VERIFY0(mprotect((caddr_t)token_cert_gen, getpagesize(), PROT_READ));
+
 	/* Finish setting up our key slots. */
 	for (slot = token_slots; slot != NULL; slot = slot->ts_next) {
 		/*
@@ -1245,25 +3308,48 @@ agent_main(zoneid_t zid, nvlist_t *zinfo, int listensock, int ctlfd)
 		 * Allocate the local agent-side state about each key and
 		 * initialise it.
 		 */
+		slots_by_id[slot->ts_id] = slot;
 		slot->ts_agent = calloc(1, sizeof (struct agent_slot));
 		VERIFY3P(slot->ts_agent, !=, NULL);
 		VERIFY0(mutex_init(&slot->ts_agent->as_mtx,
 		    USYNC_THREAD | LOCK_ERRORCHECK, NULL));
-		VERIFY0(cond_init(&slot->ts_agent->as_stchg, USYNC_THREAD, 0));
 		slot->ts_agent->as_state = AS_LOCKED;
 		VERIFY0(clock_gettime(CLOCK_MONOTONIC,
 		    &slot->ts_agent->as_renew));
 		slot->ts_agent->as_renew.tv_sec -= 60;
+		VERIFY0(sshkey_to_blob(slot->ts_public,
+		    &slot->ts_agent->as_pubblob, &slot->ts_agent->as_publen));
+		slot->ts_agent->as_pubhash = blob_hash(
+		    slot->ts_agent->as_pubblob, slot->ts_agent->as_publen);
+		if (slot->ts_type == SLOT_ASYM_CERT_SIGN)
+			make_issuer_template(slot, zid, zinfo);
 	}
 
 	/*
 	 * Open up our worker thread pool. These will sit in port_get() on the
 	 * clport event port we created above, waiting for client work to do.
+	 *
+	 * By default the pool can grow to a few threads per CPU, but the
+	 * bounds can be set in the environment.
 	 */
-	for (i = 0; i < N_THREADS; ++i) {
-		VERIFY0(thr_create(NULL, 0, client_reactor, NULL, 0,
-		    &reactor_threads[i]));
-	}
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+	maxthr = ncpu * POOL_THREADS_PER_CPU;
+	if (maxthr > POOL_MAX_THREADS)
+		maxthr = POOL_MAX_THREADS;
+	maxthr = env_uint("TOKEN_MAX_THREADS", maxthr);
+	minthr = env_uint("TOKEN_MIN_THREADS", POOL_MIN_THREADS);
+	pool_init(&reactor_pool, "reactor", clport, client_event, minthr,
+	    maxthr);
+
+	/*
+	 * The crypto threads only ever do CPU-bound work (or wait for an
+	 * unlock), so by default there's no point having more than one per
+	 * CPU.
+	 */
+	maxthr = env_uint("TOKEN_CRYPTO_THREADS", ncpu);
+	pool_init(&crypto_pool, "crypto", cryport, crypto_event, 1, maxthr);
 
 	bzero(&aa, sizeof (aa));
 	aa.a_listensock = listensock;
@@ -1275,6 +3361,8 @@ agent_main(zoneid_t zid, nvlist_t *zinfo, int listensock, int ctlfd)
 	/* Timeout for port_get() */
 	bzero(&tout, sizeof (tout));
 	tout.tv_sec = 2;
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &last_stats));
+	last_relisten = last_stats;
 
 	VERIFY0(port_associate(acport,
 	    PORT_SOURCE_FD, listensock, POLLIN, NULL));
@@ -1282,157 +3370,138 @@ agent_main(zoneid_t zid, nvlist_t *zinfo, int listensock, int ctlfd)
 	    PORT_SOURCE_FD, ctlfd, POLLIN, NULL));
 
 	while (1) {
-		rv = port_get(portfd, &ev, &tout);
+		nget = 1;
+		rv = port_getn(portfd, evs, MAX_MAIN_EVENTS, &nget, &tout);
 		if (rv == -1 && errno == EINTR) {
 			continue;
 		} else if (rv == -1 && errno == ETIME) {
-			goto checklock;
+			nget = 0;
 		} else {
 			VERIFY0(rv);
 		}
-		if (ev.portev_source == PORT_SOURCE_USER) {
-			/* Commands coming from other threads */
-			switch (ev.portev_events) {
-			case EVENT_WANT_UNLOCK:
-				bzero(&cmd, sizeof (cmd));
-				slot = (struct token_slot *)ev.portev_user;
-				cmd.cc_type = CMD_UNLOCK_KEY;
-				mutex_enter(&slot->ts_agent->as_mtx);
-				cmd.cc_cookie = slot->ts_agent->as_cookie;
-				mutex_exit(&slot->ts_agent->as_mtx);
-				cmd.cc_p1 = slot->ts_id;
-				VERIFY0(write_cmd(ctlfd, &cmd));
-				break;
-			case EVENT_WANT_LOCK:
-				bzero(&cmd, sizeof (cmd));
+
+		submitted = B_FALSE;
+		for (i = 0; i < nget; ++i) {
+			ev = evs[i];
+			if (ev.portev_source == PORT_SOURCE_USER) {
+				/*
+				 * Requests from other threads for the
+				 * supervisor. We put them all on the
+				 * submission ring, and ring the doorbell once
+				 * at the end.
+				 */
 				slot = (struct token_slot *)ev.portev_user;
-				cmd.cc_type = CMD_LOCK_KEY;
+				bzero(&req, sizeof (req));
+				switch (ev.portev_events) {
+				case EVENT_WANT_UNLOCK:
+					req.cr_type = CMD_UNLOCK_KEY;
+					break;
+				case EVENT_WANT_LOCK:
+					req.cr_type = CMD_LOCK_KEY;
+					break;
+				default:
+					VERIFY0(ev.portev_events);
+				}
 				mutex_enter(&slot->ts_agent->as_mtx);
-				cmd.cc_cookie = slot->ts_agent->as_cookie;
+				req.cr_id = slot->ts_agent->as_reqid;
 				mutex_exit(&slot->ts_agent->as_mtx);
-				cmd.cc_p1 = slot->ts_id;
-				VERIFY0(write_cmd(ctlfd, &cmd));
-				break;
-			default:
-				VERIFY0(ev.portev_events);
-			}
+				req.cr_slot = slot->ts_id;
+				submit_req(&req);
+				submitted = B_TRUE;
 
-		} else if (ev.portev_object == ctlfd) {
-			/*
-			 * Commands (or responses) coming from the parent (the
-			 * soft-token supervisor)
-			 */
-			VERIFY0(read_cmd(ctlfd, &cmd));
-			cmdtype = cmd.cc_type;
-			switch (cmdtype) {
-			case CMD_STATUS:
+			} else if (ev.portev_object == ctlfd) {
 				/*
-				 * A response to a previous command. This is
-				 * either a resonse to a LOCK or an UNLOCK
-				 * command, so find the slot it was for.
+				 * Commands coming from the parent (the
+				 * soft-token supervisor): either a doorbell
+				 * for the completion ring, or shutdown.
 				 */
-				as = NULL;
-				was_renew = B_FALSE;
-				for (slot = token_slots; slot != NULL;
-				    slot = slot->ts_next) {
-					as = slot->ts_agent;
-					mutex_enter(&as->as_mtx);
-					if (as->as_cookie == cmd.cc_cookie) {
-						/* NOTE: no mutex_exit */
-						break;
-					}
-					if (as->as_renew_cookie ==
-					    cmd.cc_cookie) {
-						/* NOTE: no mutex_exit */
-						was_renew = B_TRUE;
-						break;
-					}
-					mutex_exit(&as->as_mtx);
-				}
-				if (as != NULL && !was_renew) {
-					as->as_cookie = 0;
-					VERIFY3U(cmd.cc_p1, ==, STATUS_OK);
-					switch (as->as_state) {
-					case AS_UNLOCKING:
-						as->as_state = AS_UNLOCKED;
-						break;
-					case AS_LOCKING:
-						as->as_state = AS_LOCKED;
-						break;
-					default:
-						assert(0);
+				VERIFY0(read_cmd(ctlfd, &cmd));
+				cmdtype = cmd.cc_type;
+				switch (cmdtype) {
+				case CMD_RING:
+					while (ctl_ring_get(
+					    &token_ctl_rings->cr_cq,
+					    &req) == 0) {
+						handle_reply(&req);
 					}
-					VERIFY0(cond_broadcast(&as->as_stchg));
-					mutex_exit(&as->as_mtx);
-				}
-				if (as != NULL && was_renew) {
-					as->as_renew_cookie = 0;
-					if (cmd.cc_p1 == STATUS_OK) {
-						VERIFY0(clock_gettime(
-						    CLOCK_MONOTONIC,
-						    &as->as_renew));
-					}
-					mutex_exit(&as->as_mtx);
-				}
-				break;
-			case CMD_SHUTDOWN:
-				/*
-				 * Parent is asking us to wind up and stop
-				 * operation.
-				 */
-				bunyan_log(TRACE, "posting stop events", NULL);
-				VERIFY0(port_send(acport, EVENT_STOP, NULL));
-				for (i = 0; i < N_THREADS; ++i) {
-					VERIFY0(port_send(clport,
-					    EVENT_STOP, NULL));
-				}
-				VERIFY0(thr_join(acceptor_thread, NULL, NULL));
-				for (i = 0; i < N_THREADS; ++i) {
-					VERIFY0(thr_join(reactor_threads[i],
-					    NULL, NULL));
+					break;
+				case CMD_SHUTDOWN:
+					/*
+					 * Parent is asking us to wind up and
+					 * stop operation.
+					 */
+					bunyan_log(TRACE, "posting stop events",
+					    NULL);
+					VERIFY0(port_send(acport, EVENT_STOP,
+					    NULL));
+					VERIFY0(thr_join(acceptor_thread, NULL,
+					    NULL));
+					pool_stop(&reactor_pool);
+					pool_stop(&crypto_pool);
+					exit(0);
+					break;
+				default:
+					bunyan_log(ERROR,
+					    "parent sent unknown cmd type",
+					    "type", BNY_INT, cmdtype, NULL);
+					break;
 				}
-				exit(0);
-				break;
-			default:
-				bunyan_log(ERROR,
-				    "parent sent unknown cmd type",
-				    "type", BNY_INT, cmdtype, NULL);
-				break;
-			}
-			VERIFY0(port_associate(portfd,
-			    PORT_SOURCE_FD, ctlfd, POLLIN, NULL));
+				VERIFY0(port_associate(portfd,
+				    PORT_SOURCE_FD, ctlfd, POLLIN, NULL));
 
-		} else {
-			assert(0);
+			} else {
+				assert(0);
+			}
 		}
 
 		/*
-		 * After each event we handle (or every 1sec), we want to check
-		 * through all the unlocked keys and see if any have been
-		 * unused for >=5sec.
+		 * After each batch of events we handle (or every 2sec), we
+		 * want to check through all the unlocked keys and see if any
+		 * have been unused for >=5sec.
 		 *
 		 * If they're an idle key, we should lock them so they're no
 		 * longer present in memory.
 		 */
-checklock:
 		VERIFY0(clock_gettime(CLOCK_MONOTONIC, &now));
+		tspec_subtract(&delta, &now, &last_stats);
+		if (delta.tv_sec >= STATS_INTERVAL) {
+			log_stats();
+			last_stats = now;
+		}
+		bunyan_hist_tick();
+
+		tspec_subtract(&delta, &now, &last_relisten);
+		if (delta.tv_sec >= 1) {
+			mutex_enter(&clients_mtx);
+			if (listen_paused && nclients < max_clients) {
+				listen_paused = B_FALSE;
+				VERIFY0(port_associate(acport,
+				    PORT_SOURCE_FD, listen_fd, POLLIN, NULL));
+			}
+			mutex_exit(&clients_mtx);
+			last_relisten = now;
+		}
+
 		for (slot = token_slots; slot != NULL; slot = slot->ts_next) {
 			as = slot->ts_agent;
 			mutex_enter(&as->as_mtx);
 			tspec_subtract(&delta, &now, &as->as_renew);
-			if (delta.tv_sec >= 60 && as->as_renew_cookie == 0) {
-				as->as_renew_cookie = next_cookie();
+			if (delta.tv_sec >= 60 && as->as_renew_id == 0) {
+				as->as_renew_id = next_reqid(slot);
 
 				bunyan_log(INFO,
 				    "renewing certificate",
 				    "slot_name", BNY_STRING, slot->ts_name,
 				    NULL);
 
-				bzero(&cmd, sizeof (cmd));
-				cmd.cc_type = CMD_RENEW_CERT;
-				cmd.cc_cookie = as->as_renew_cookie;
-				cmd.cc_p1 = slot->ts_id;
-				VERIFY0(write_cmd(ctlfd, &cmd));
+				bzero(&req, sizeof (req));
+				req.cr_type = CMD_RENEW_CERT;
+				req.cr_id = as->as_renew_id;
+				req.cr_slot = slot->ts_id;
+				SOFTTOKEN_RENEW_REQUEST((char *)slot->ts_name,
+				    req.cr_id);
+				submit_req(&req);
+				submitted = B_TRUE;
 			}
 			if (as->as_state != AS_UNLOCKED || as->as_ref > 0) {
 				mutex_exit(&as->as_mtx);
@@ -1445,13 +3514,19 @@ checklock:
 				    "keyname", BNY_STRING, slot->ts_name,
 				    "idle_sec", BNY_INT, (int)delta.tv_sec,
 				    NULL);
-				as->as_cookie = next_cookie();
+				as->as_reqid = next_reqid(slot);
+				fr_record(FR_SLOT_STATE, slot->ts_id,
+				    AS_UNLOCKED, AS_LOCKING, 0);
 				as->as_state = AS_LOCKING;
+				SOFTTOKEN_LOCK_REQUEST((char *)slot->ts_name,
+				    as->as_reqid);
 				VERIFY0(port_send(mport, EVENT_WANT_LOCK,
 				    slot));
-				VERIFY0(cond_broadcast(&as->as_stchg));
 			}
 			mutex_exit(&as->as_mtx);
 		}
+
+		if (submitted)
+			VERIFY0(ring_doorbell(ctlfd));
 	}
 }
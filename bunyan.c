@@ -16,15 +16,20 @@
 #include <limits.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <synch.h>
 #include <thread.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
 #include <netdb.h>
 #include <strings.h>
+#include <signal.h>
+#include <atomic.h>
 
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/debug.h>
 #include <sys/sdt.h>
 #include <libnvpair.h>
@@ -37,7 +42,7 @@ static mutex_t bunyan_bmutex;
 mutex_t *bunyan_wrmutex = NULL;
 static void *bunyan_shmem = NULL;
 static nvlist_t *bunyan_base = NULL;
-static enum bunyan_log_level bunyan_min_level = INFO;
+volatile enum bunyan_log_level bunyan_min_level = INFO;
 
 struct bunyan_timers {
 	struct timer_block *bt_first;
@@ -55,6 +60,101 @@ struct timer_block {
 
 #define	NS_PER_S	1000000000ULL
 
+/*
+ * The agent doesn't write its log lines to stderr (a pipe to the supervisor)
+ * itself: that cost it a write() per line, and the supervisor a port event,
+ * a read() and a write() per line too. Instead the supervisor sets up a
+ * shared ring of bytes before it forks the agent, and the agent copies each
+ * (complete, newline-terminated) JSON line into it. The supervisor drains
+ * everything in the ring to its own stderr with one writev() at a time.
+ *
+ * There's only one producer (the agent, whose threads take turns using
+ * bunyan_ring_mtx) and one consumer (the supervisor), so br_head and br_tail
+ * are each only written by one side. If a line doesn't fit, it's dropped and
+ * counted in br_dropped rather than making the agent wait.
+ *
+ * The agent only makes a syscall when the supervisor has gone to sleep (it
+ * sets br_waiting first): then it writes a single NUL byte down the old pipe
+ * to wake it up.
+ */
+#define	BUNYAN_RING_SIZE	(256 * 1024)	/* must be a power of 2 */
+
+struct bunyan_ring {
+	volatile uint32_t br_head;
+	volatile uint32_t br_tail;
+	volatile uint32_t br_waiting;
+	volatile uint64_t br_dropped;
+	char br_data[BUNYAN_RING_SIZE];
+};
+
+static struct bunyan_ring *bunyan_ring = NULL;
+static boolean_t bunyan_ring_producer = B_FALSE;
+static int bunyan_ring_wakefd = -1;
+static mutex_t bunyan_ring_mtx;
+static uint64_t bunyan_ring_lastdrop = 0;
+
+/* A growable buffer that we render JSON log lines into. */
+struct bny_buf {
+	char *bb_data;
+	size_t bb_len;
+	size_t bb_alloc;
+};
+
+/*
+ * The fields that are the same in every record (v, name, hostname, pid and
+ * everything from bunyan_set()) are rendered once, as the start of a JSON
+ * object, into bunyan_base_json. Changing any of them bumps bunyan_base_gen.
+ *
+ * Each thread keeps its own buffer to render records into, which always
+ * starts with a copy of the base fields: it only needs to re-copy them (under
+ * bunyan_bmutex) when it sees that bunyan_base_gen has moved on.
+ *
+ * Fields that only apply to what one thread is doing right now (like which
+ * client it's serving) go in tb_ctx instead, via bunyan_thread_set(). That's
+ * rendered once and appended after the base fields, and doesn't need a lock.
+ *
+ * Threads come and go (the agent's pools shrink when they're idle), so the
+ * first time a thread logs, we hang its buffers off bunyan_tbuf_key too, just
+ * so that bunyan_tbuf_free() gets called to free them when it exits.
+ */
+static struct bny_buf bunyan_base_json;
+static volatile uint_t bunyan_base_gen = 1;
+static uint_t bunyan_base_built = 0;
+
+struct bny_tbuf {
+	struct bny_buf tb_buf;
+	size_t tb_baselen;
+	uint_t tb_gen;
+	struct bny_buf tb_ctx;
+	boolean_t tb_registered;
+};
+static __thread struct bny_tbuf bunyan_tbuf;
+static thread_key_t bunyan_tbuf_key = THR_ONCE_KEY;
+
+static void
+bunyan_tbuf_free(void *arg)
+{
+	struct bny_tbuf *tb = arg;
+
+	free(tb->tb_buf.bb_data);
+	free(tb->tb_ctx.bb_data);
+	bzero(tb, sizeof (*tb));
+}
+
+static struct bny_tbuf *
+bunyan_tbuf_get(void)
+{
+	struct bny_tbuf *tb = &bunyan_tbuf;
+
+	if (!tb->tb_registered) {
+		VERIFY0(thr_keycreate_once(&bunyan_tbuf_key,
+		    bunyan_tbuf_free));
+		VERIFY0(thr_setspecific(bunyan_tbuf_key, tb));
+		tb->tb_registered = B_TRUE;
+	}
+	return (tb);
+}
+
 static inline char
 nybble_to_hex(uint8_t nybble)
 {
@@ -96,33 +196,12 @@ tspec_subtract(struct timespec *result, const struct timespec *x,
 	result->tv_nsec = xcarry.tv_nsec - y->tv_nsec;
 }
 
-static int
-bny_timers_to_nvl(struct bunyan_timers *tms, nvlist_t *nvl)
-{
-	struct timer_block *b;
-	size_t idx;
-	uint64_t usec;
-	int rv;
-
-	for (b = tms->bt_first; b != NULL; b = b->tb_next) {
-		for (idx = 0; idx < b->tb_pos; ++idx) {
-			usec = b->tb_timers[idx].tv_nsec / 1000;
-			usec += b->tb_timers[idx].tv_sec * 1000000;
-			if ((rv = nvlist_add_uint64(nvl,
-			    b->tb_names[idx], usec))) {
-				return (rv);
-			}
-		}
-	}
-	return (0);
-}
-
 void
 bunyan_set_level(enum bunyan_log_level level)
 {
-	mutex_enter(&bunyan_bmutex);
+	/* Readers don't take a lock, see bunyan_log() in bunyan.h */
 	bunyan_min_level = level;
-	mutex_exit(&bunyan_bmutex);
+	membar_producer();
 }
 
 struct bunyan_timers *
@@ -187,6 +266,284 @@ bny_timers_free(struct bunyan_timers *tms)
 	free(tms);
 }
 
+/*
+ * As well as attaching a set of timers to a single log record, we can add
+ * them into process-wide histograms (one per prefix and phase name, e.g.
+ * "unlock" and "decrypt"), which bunyan_hist_tick() logs a summary of every
+ * so often, or on SIGUSR1.
+ *
+ * The histograms are log-linear, over microseconds: values below
+ * 2^BNY_HIST_SUB_BITS get a bucket each, and after that every power of 2 is
+ * split into 2^BNY_HIST_SUB_BITS equal buckets (so each is accurate to within
+ * 12.5%). Values are added with atomics, so there's no locking on the way
+ * in; only creating a new histogram takes bunyan_bmutex.
+ */
+#define	BNY_HIST_SUB_BITS	3
+#define	BNY_HIST_SUB		(1 << BNY_HIST_SUB_BITS)
+#define	BNY_HIST_MAX_EXP	40
+#define	BNY_HIST_BUCKETS	\
+	(BNY_HIST_SUB + \
+	(BNY_HIST_MAX_EXP - BNY_HIST_SUB_BITS + 1) * BNY_HIST_SUB)
+#define	BNY_HIST_MAX		48
+
+struct bny_hist {
+	const char *bh_prefix;
+	const char *bh_phase;
+	volatile uint64_t bh_count;
+	volatile uint64_t bh_max;
+	volatile uint64_t bh_buckets[BNY_HIST_BUCKETS];
+};
+
+static struct bny_hist bunyan_hists[BNY_HIST_MAX];
+static volatile uint_t bunyan_nhists = 0;
+static uint_t bunyan_hist_interval = 0;
+static struct timespec bunyan_hist_last;
+static volatile sig_atomic_t bunyan_hist_wanted = 0;
+
+static uint_t
+bny_hist_bucket(uint64_t v)
+{
+	uint_t e;
+
+	if (v < BNY_HIST_SUB)
+		return ((uint_t)v);
+	e = 63 - __builtin_clzll(v);
+	if (e > BNY_HIST_MAX_EXP)
+		return (BNY_HIST_BUCKETS - 1);
+	return (BNY_HIST_SUB + (e - BNY_HIST_SUB_BITS) * BNY_HIST_SUB +
+	    ((v >> (e - BNY_HIST_SUB_BITS)) & (BNY_HIST_SUB - 1)));
+}
+
+/* The largest value that falls into bucket b. */
+static uint64_t
+bny_hist_bucket_max(uint_t b)
+{
+	uint_t e, sub;
+
+	if (b < BNY_HIST_SUB)
+		return (b);
+	e = (b - BNY_HIST_SUB) / BNY_HIST_SUB + BNY_HIST_SUB_BITS;
+	sub = (b - BNY_HIST_SUB) % BNY_HIST_SUB;
+	return ((1ULL << e) + ((uint64_t)(sub + 1) << (e - BNY_HIST_SUB_BITS))
+	    - 1);
+}
+
+static struct bny_hist *
+bny_hist_find(const char *prefix, const char *phase)
+{
+	struct bny_hist *h;
+	uint_t i, n;
+
+	n = bunyan_nhists;
+	membar_consumer();
+	for (i = 0; i < n; ++i) {
+		h = &bunyan_hists[i];
+		if (strcmp(h->bh_prefix, prefix) == 0 &&
+		    strcmp(h->bh_phase, phase) == 0) {
+			return (h);
+		}
+	}
+
+	mutex_enter(&bunyan_bmutex);
+	for (i = 0; i < bunyan_nhists; ++i) {
+		h = &bunyan_hists[i];
+		if (strcmp(h->bh_prefix, prefix) == 0 &&
+		    strcmp(h->bh_phase, phase) == 0) {
+			mutex_exit(&bunyan_bmutex);
+			return (h);
+		}
+	}
+	if (bunyan_nhists >= BNY_HIST_MAX) {
+		mutex_exit(&bunyan_bmutex);
+		return (NULL);
+	}
+	h = &bunyan_hists[bunyan_nhists];
+	h->bh_prefix = strdup(prefix);
+	h->bh_phase = strdup(phase);
+	VERIFY(h->bh_prefix != NULL && h->bh_phase != NULL);
+	membar_producer();
+	++bunyan_nhists;
+	mutex_exit(&bunyan_bmutex);
+	return (h);
+}
+
+/* Adds a single value (in usec) to the histogram for prefix/phase. */
+void
+bny_hist_add(const char *prefix, const char *phase, uint64_t usec)
+{
+	struct bny_hist *h;
+	uint64_t max;
+
+	if ((h = bny_hist_find(prefix, phase)) == NULL)
+		return;
+	atomic_inc_64(&h->bh_buckets[bny_hist_bucket(usec)]);
+	atomic_inc_64(&h->bh_count);
+	while ((max = h->bh_max) < usec &&
+	    atomic_cas_64(&h->bh_max, max, usec) != max)
+		;
+}
+
+/*
+ * Adds each phase of a set of timers to its histogram under the given prefix,
+ * and the sum of them all to "total".
+ */
+void
+bny_timers_record(struct bunyan_timers *tms, const char *prefix)
+{
+	struct timer_block *b;
+	size_t idx;
+	uint64_t usec, total = 0;
+
+	for (b = tms->bt_first; b != NULL; b = b->tb_next) {
+		for (idx = 0; idx < b->tb_pos; ++idx) {
+			usec = b->tb_timers[idx].tv_nsec / 1000;
+			usec += b->tb_timers[idx].tv_sec * 1000000;
+			bny_hist_add(prefix, b->tb_names[idx], usec);
+			total += usec;
+		}
+	}
+	bny_hist_add(prefix, "total", total);
+}
+
+static void
+bunyan_hist_sigusr1(int sig)
+{
+	bunyan_hist_wanted = 1;
+}
+
+/*
+ * Sets up the histograms to be logged every interval_sec seconds (if not 0),
+ * and whenever we get a SIGUSR1. The handler is inherited by our children,
+ * which should all call bunyan_hist_tick() regularly.
+ */
+void
+bunyan_hist_init(uint_t interval_sec)
+{
+	struct sigaction sa;
+
+	bunyan_hist_interval = interval_sec;
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &bunyan_hist_last));
+
+	bzero(&sa, sizeof (sa));
+	sa.sa_handler = bunyan_hist_sigusr1;
+	sa.sa_flags = SA_RESTART;
+	VERIFY0(sigaction(SIGUSR1, &sa, NULL));
+}
+
+/*
+ * Adds the count/p50/p90/p99/max of every histogram with anything in it to
+ * nvl, as an nvlist named "prefix.phase". If reset is set, the histograms
+ * start again from empty.
+ */
+static void
+bny_hist_summary(nvlist_t *nvl, boolean_t reset)
+{
+	uint64_t counts[BNY_HIST_BUCKETS];
+	struct bny_hist *h;
+	nvlist_t *hnvl;
+	uint64_t count, max, want[3], seen, seen_max;
+	uint_t i, b, q, n;
+	const double qs[3] = { 0.5, 0.9, 0.99 };
+	const char *qnames[3] = { "p50", "p90", "p99" };
+	char name[128];
+
+	n = bunyan_nhists;
+	membar_consumer();
+	for (i = 0; i < n; ++i) {
+		h = &bunyan_hists[i];
+		count = 0;
+		for (b = 0; b < BNY_HIST_BUCKETS; ++b) {
+			if (reset) {
+				counts[b] = atomic_swap_64(
+				    &h->bh_buckets[b], 0);
+			} else {
+				counts[b] = h->bh_buckets[b];
+			}
+			count += counts[b];
+		}
+		if (reset) {
+			(void) atomic_swap_64(&h->bh_count, 0);
+			max = atomic_swap_64(&h->bh_max, 0);
+		} else {
+			max = h->bh_max;
+		}
+		if (count == 0)
+			continue;
+
+		VERIFY0(nvlist_alloc(&hnvl, NV_UNIQUE_NAME, 0));
+		VERIFY0(nvlist_add_uint64(hnvl, "count", count));
+		for (q = 0; q < 3; ++q)
+			want[q] = (uint64_t)(qs[q] * count + 0.5);
+		seen = 0;
+		q = 0;
+		for (b = 0; b < BNY_HIST_BUCKETS && q < 3; ++b) {
+			seen += counts[b];
+			while (q < 3 && seen >= want[q] && seen > 0) {
+				seen_max = bny_hist_bucket_max(b);
+				if (seen_max > max)
+					seen_max = max;
+				VERIFY0(nvlist_add_uint64(hnvl, qnames[q],
+				    seen_max));
+				++q;
+			}
+		}
+		VERIFY0(nvlist_add_uint64(hnvl, "max", max));
+
+		(void) snprintf(name, sizeof (name), "%s.%s", h->bh_prefix,
+		    h->bh_phase);
+		VERIFY0(nvlist_add_nvlist(nvl, name, hnvl));
+		nvlist_free(hnvl);
+	}
+}
+
+/*
+ * Adds a summary of each histogram to nvl (see bny_hist_summary()), covering
+ * the time since they were last logged, without resetting them.
+ */
+void
+bunyan_hist_nvl(nvlist_t *nvl)
+{
+	bny_hist_summary(nvl, B_FALSE);
+}
+
+/*
+ * Logs the histograms as one record, and starts them all again from empty.
+ */
+static void
+bunyan_hist_dump(uint_t period)
+{
+	nvlist_t *nvl;
+
+	VERIFY0(nvlist_alloc(&nvl, NV_UNIQUE_NAME, 0));
+	bny_hist_summary(nvl, B_TRUE);
+	if (nvlist_next_nvpair(nvl, NULL) != NULL) {
+		bunyan_log(INFO, "latency histograms (usec)",
+		    "period_sec", BNY_UINT, period,
+		    "histograms", BNY_NVLIST, nvl, NULL);
+	}
+	nvlist_free(nvl);
+}
+
+/*
+ * Logs the histograms if we've had a SIGUSR1, or it's been long enough since
+ * the last time. Should be called regularly from each process's main loop.
+ */
+void
+bunyan_hist_tick(void)
+{
+	struct timespec now, delta;
+
+	VERIFY0(clock_gettime(CLOCK_MONOTONIC, &now));
+	tspec_subtract(&delta, &now, &bunyan_hist_last);
+	if (!bunyan_hist_wanted && (bunyan_hist_interval == 0 ||
+	    delta.tv_sec < bunyan_hist_interval)) {
+		return;
+	}
+	bunyan_hist_wanted = 0;
+	bunyan_hist_last = now;
+	bunyan_hist_dump(delta.tv_sec);
+}
+
 void
 bunyan_unshare(void)
 {
@@ -202,6 +559,16 @@ bunyan_unshare(void)
 	    NULL));
 }
 
+/*
+ * Throws away the pre-rendered base fields. This is also our fork handler,
+ * since the pid is one of them.
+ */
+static void
+bunyan_base_changed(void)
+{
+	atomic_inc_uint(&bunyan_base_gen);
+}
+
 void
 bunyan_init(void)
 {
@@ -218,6 +585,132 @@ bunyan_init(void)
 	    NULL));
 	VERIFY0(nvlist_alloc(&bunyan_base, NV_UNIQUE_NAME, 0));
 	VERIFY0(nvlist_add_int32(bunyan_base, "v", 1));
+	VERIFY0(pthread_atfork(NULL, NULL, bunyan_base_changed));
+}
+
+/*
+ * Called by the supervisor before it forks the agent: sets up the shared log
+ * ring. See struct bunyan_ring.
+ */
+void
+bunyan_ring_create(void)
+{
+	VERIFY3P(bunyan_ring, ==, NULL);
+	bunyan_ring = mmap(0, sizeof (struct bunyan_ring),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	VERIFY(bunyan_ring != MAP_FAILED);
+	bzero(bunyan_ring, offsetof(struct bunyan_ring, br_data));
+}
+
+/*
+ * Called in the agent after forking: from now on, log lines go into the ring
+ * rather than to stderr, and we poke wakefd when the supervisor needs waking.
+ */
+void
+bunyan_ring_produce(int wakefd)
+{
+	VERIFY3P(bunyan_ring, !=, NULL);
+	VERIFY0(mutex_init(&bunyan_ring_mtx, USYNC_THREAD | LOCK_ERRORCHECK,
+	    NULL));
+	bunyan_ring_wakefd = wakefd;
+	bunyan_ring_producer = B_TRUE;
+}
+
+static void
+bunyan_ring_put(const char *line, size_t len)
+{
+	struct bunyan_ring *r = bunyan_ring;
+	uint32_t head, off, n;
+	char nul = 0;
+
+	mutex_enter(&bunyan_ring_mtx);
+	head = r->br_head;
+	membar_consumer();
+	if (len > BUNYAN_RING_SIZE - (head - r->br_tail)) {
+		atomic_inc_64(&r->br_dropped);
+		mutex_exit(&bunyan_ring_mtx);
+		return;
+	}
+	off = head & (BUNYAN_RING_SIZE - 1);
+	n = BUNYAN_RING_SIZE - off;
+	if (n > len)
+		n = len;
+	bcopy(line, &r->br_data[off], n);
+	bcopy(line + n, &r->br_data[0], len - n);
+	membar_producer();
+	r->br_head = head + len;
+	membar_enter();
+	if (atomic_cas_32(&r->br_waiting, 1, 0) == 1)
+		(void) write(bunyan_ring_wakefd, &nul, 1);
+	mutex_exit(&bunyan_ring_mtx);
+}
+
+/*
+ * Called by the supervisor: writes everything in the ring out to fd (under
+ * bunyan_wrmutex, so it doesn't get mixed up with passed-through output), and
+ * reports any lines the agent had to drop. When this returns, the ring was
+ * empty and br_waiting is set, so the agent will wake us for the next line.
+ */
+void
+bunyan_ring_drain(int fd)
+{
+	struct bunyan_ring *r = bunyan_ring;
+	struct iovec iov[2];
+	uint32_t head, tail, off, len;
+	uint64_t dropped;
+	ssize_t rv;
+	int niov;
+
+	if (r == NULL)
+		return;
+
+	while (1) {
+		head = r->br_head;
+		membar_consumer();
+		tail = r->br_tail;
+		if (head == tail) {
+			r->br_waiting = 1;
+			membar_enter();
+			if (r->br_head == tail)
+				break;
+			r->br_waiting = 0;
+			continue;
+		}
+
+		off = tail & (BUNYAN_RING_SIZE - 1);
+		len = head - tail;
+		niov = 0;
+		iov[niov].iov_base = &r->br_data[off];
+		iov[niov].iov_len = BUNYAN_RING_SIZE - off;
+		if (iov[niov].iov_len >= len) {
+			iov[niov++].iov_len = len;
+		} else {
+			len -= iov[niov++].iov_len;
+			iov[niov].iov_base = &r->br_data[0];
+			iov[niov++].iov_len = len;
+		}
+
+		mutex_enter(bunyan_wrmutex);
+		do {
+			rv = writev(fd, iov, niov);
+		} while (rv == -1 && errno == EINTR);
+		mutex_exit(bunyan_wrmutex);
+
+		/*
+		 * If the write fails or is short we just lose those lines:
+		 * there isn't anywhere else for them to go.
+		 */
+		membar_exit();
+		r->br_tail = head;
+	}
+
+	dropped = r->br_dropped;
+	if (dropped != bunyan_ring_lastdrop) {
+		bunyan_log(WARN, "agent log ring was full, lines dropped",
+		    "dropped", BNY_UINT64, dropped - bunyan_ring_lastdrop,
+		    NULL);
+		bunyan_ring_lastdrop = dropped;
+	}
 }
 
 void
@@ -225,6 +718,7 @@ bunyan_set_name(const char *name)
 {
 	mutex_enter(&bunyan_bmutex);
 	bunyan_name = name;
+	bunyan_base_changed();
 	mutex_exit(&bunyan_bmutex);
 }
 
@@ -239,19 +733,287 @@ bunyan_get_hostname(void)
 	bunyan_hostname = buf;
 }
 
-static void
-bunyan_timestamp(char *buffer, size_t len)
+/*
+ * Formatting the date part of a timestamp is the expensive bit, and it only
+ * changes once a second, so each thread keeps the "YYYY-MM-DDTHH:MM:SS."
+ * prefix for the last second it logged in, and we just patch on the
+ * milliseconds.
+ */
+#define	BNY_TS_PREFIX_LEN	20
+
+struct bny_tscache {
+	time_t tc_sec;
+	char tc_prefix[BNY_TS_PREFIX_LEN + 1];
+};
+static __thread struct bny_tscache bunyan_tscache = { -1 };
+
+/*
+ * With the coarse clock switched on (bunyan_set_coarse_clock()), we don't
+ * read the clock for each record at all: a ticker thread stores the time (in
+ * ms since the epoch) in bunyan_coarse_ms every BNY_COARSE_TICK_MS, and we
+ * use that. Timestamps are then only accurate to within a tick.
+ */
+#define	BNY_COARSE_TICK_MS	10
+
+static boolean_t bunyan_coarse = B_FALSE;
+static boolean_t bunyan_coarse_running = B_FALSE;
+static volatile uint64_t bunyan_coarse_ms;
+
+static uint64_t
+bunyan_clock_ms(void)
 {
 	struct timespec ts;
-	struct tm *info;
 
 	VERIFY0(clock_gettime(CLOCK_REALTIME, &ts));
-	info = gmtime(&ts.tv_sec);
-	VERIFY(info != NULL);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void *
+bunyan_ticker(void *arg)
+{
+	struct timespec ts;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = BNY_COARSE_TICK_MS * 1000000;
+	while (1) {
+		(void) atomic_swap_64(&bunyan_coarse_ms, bunyan_clock_ms());
+		(void) nanosleep(&ts, NULL);
+	}
+	return (NULL);
+}
+
+static void
+bunyan_ticker_start(void)
+{
+	mutex_enter(&bunyan_bmutex);
+	if (!bunyan_coarse_running) {
+		(void) atomic_swap_64(&bunyan_coarse_ms, bunyan_clock_ms());
+		VERIFY0(thr_create(NULL, 0, bunyan_ticker, NULL,
+		    THR_DETACHED, NULL));
+		bunyan_coarse_running = B_TRUE;
+	}
+	mutex_exit(&bunyan_bmutex);
+}
 
-	snprintf(buffer, len, "%04d-%02d-%02dT%02d:%02d:%02d.%03ldZ",
-	    info->tm_year + 1900, info->tm_mon + 1, info->tm_mday,
-	    info->tm_hour, info->tm_min, info->tm_sec, ts.tv_nsec / 1000000);
+/* The ticker doesn't follow us across a fork; start another one on demand. */
+static void
+bunyan_ticker_postfork_child(void)
+{
+	bunyan_coarse_running = B_FALSE;
+}
+
+void
+bunyan_set_coarse_clock(boolean_t coarse)
+{
+	static boolean_t registered = B_FALSE;
+
+	mutex_enter(&bunyan_bmutex);
+	if (!registered) {
+		VERIFY0(pthread_atfork(NULL, NULL,
+		    bunyan_ticker_postfork_child));
+		registered = B_TRUE;
+	}
+	bunyan_coarse = coarse;
+	mutex_exit(&bunyan_bmutex);
+}
+
+/* The time to stamp on a record, in ms since the epoch. */
+static uint64_t
+bunyan_now_ms(void)
+{
+	if (bunyan_coarse) {
+		if (!bunyan_coarse_running)
+			bunyan_ticker_start();
+		return (atomic_add_64_nv(&bunyan_coarse_ms, 0));
+	}
+	return (bunyan_clock_ms());
+}
+
+/* Writes the timestamp into buffer, which must have room for 25 bytes. */
+static void
+bunyan_timestamp(char *buffer, uint64_t ms)
+{
+	struct bny_tscache *tc = &bunyan_tscache;
+	time_t sec;
+	uint_t msec;
+	struct tm info;
+
+	sec = ms / 1000;
+	msec = ms % 1000;
+
+	if (sec != tc->tc_sec) {
+		VERIFY(gmtime_r(&sec, &info) != NULL);
+		(void) snprintf(tc->tc_prefix, sizeof (tc->tc_prefix),
+		    "%04d-%02d-%02dT%02d:%02d:%02d.",
+		    info.tm_year + 1900, info.tm_mon + 1, info.tm_mday,
+		    info.tm_hour, info.tm_min, info.tm_sec);
+		tc->tc_sec = sec;
+	}
+
+	bcopy(tc->tc_prefix, buffer, BNY_TS_PREFIX_LEN);
+	buffer[BNY_TS_PREFIX_LEN] = '0' + msec / 100;
+	buffer[BNY_TS_PREFIX_LEN + 1] = '0' + (msec / 10) % 10;
+	buffer[BNY_TS_PREFIX_LEN + 2] = '0' + msec % 10;
+	buffer[BNY_TS_PREFIX_LEN + 3] = 'Z';
+	buffer[BNY_TS_PREFIX_LEN + 4] = '\0';
+}
+
+static void
+bny_buf_reserve(struct bny_buf *b, size_t n)
+{
+	char *nd;
+	size_t nalloc;
+
+	if (b->bb_len + n <= b->bb_alloc)
+		return;
+	nalloc = b->bb_alloc ? b->bb_alloc : 512;
+	while (b->bb_len + n > nalloc)
+		nalloc *= 2;
+	nd = realloc(b->bb_data, nalloc);
+	VERIFY(nd != NULL);
+	b->bb_data = nd;
+	b->bb_alloc = nalloc;
+}
+
+static void
+bny_buf_put(struct bny_buf *b, const char *data, size_t len)
+{
+	bny_buf_reserve(b, len);
+	bcopy(data, &b->bb_data[b->bb_len], len);
+	b->bb_len += len;
+}
+
+static void
+bny_buf_printf(struct bny_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	VERIFY3S(n, >=, 0);
+	bny_buf_reserve(b, n + 1);
+	va_start(ap, fmt);
+	(void) vsnprintf(&b->bb_data[b->bb_len], n + 1, fmt, ap);
+	va_end(ap);
+	b->bb_len += n;
+}
+
+static void
+bny_json_string(struct bny_buf *b, const char *str)
+{
+	const char *p;
+
+	bny_buf_put(b, "\"", 1);
+	for (p = str; *p != '\0'; ++p) {
+		switch (*p) {
+		case '"':
+			bny_buf_put(b, "\\\"", 2);
+			break;
+		case '\\':
+			bny_buf_put(b, "\\\\", 2);
+			break;
+		case '\n':
+			bny_buf_put(b, "\\n", 2);
+			break;
+		case '\r':
+			bny_buf_put(b, "\\r", 2);
+			break;
+		case '\t':
+			bny_buf_put(b, "\\t", 2);
+			break;
+		default:
+			if ((uint8_t)*p < 0x20)
+				bny_buf_printf(b, "\\u%04x", (uint8_t)*p);
+			else
+				bny_buf_put(b, p, 1);
+		}
+	}
+	bny_buf_put(b, "\"", 1);
+}
+
+/*
+ * Renders an nvlist as a JSON object, the same way nvlist_print_json() would
+ * (for the types we actually log), but into a buffer rather than a FILE.
+ */
+static void
+bny_json_nvl(struct bny_buf *b, nvlist_t *nvl)
+{
+	nvpair_t *pair;
+	boolean_t first = B_TRUE;
+	char *strval;
+	int32_t i32;
+	uint32_t u32;
+	int64_t i64;
+	uint64_t u64;
+	boolean_t bval;
+	nvlist_t *nvlval;
+
+	bny_buf_put(b, "{", 1);
+	for (pair = nvlist_next_nvpair(nvl, NULL); pair != NULL;
+	    pair = nvlist_next_nvpair(nvl, pair)) {
+		if (!first)
+			bny_buf_put(b, ",", 1);
+		first = B_FALSE;
+		bny_json_string(b, nvpair_name(pair));
+		bny_buf_put(b, ":", 1);
+
+		switch (nvpair_type(pair)) {
+		case DATA_TYPE_STRING:
+			VERIFY0(nvpair_value_string(pair, &strval));
+			bny_json_string(b, strval);
+			break;
+		case DATA_TYPE_INT32:
+			VERIFY0(nvpair_value_int32(pair, &i32));
+			bny_buf_printf(b, "%d", i32);
+			break;
+		case DATA_TYPE_UINT32:
+			VERIFY0(nvpair_value_uint32(pair, &u32));
+			bny_buf_printf(b, "%u", u32);
+			break;
+		case DATA_TYPE_INT64:
+			VERIFY0(nvpair_value_int64(pair, &i64));
+			bny_buf_printf(b, "%lld", (long long)i64);
+			break;
+		case DATA_TYPE_UINT64:
+			VERIFY0(nvpair_value_uint64(pair, &u64));
+			bny_buf_printf(b, "%llu", (unsigned long long)u64);
+			break;
+		case DATA_TYPE_BOOLEAN_VALUE:
+			VERIFY0(nvpair_value_boolean_value(pair, &bval));
+			bny_buf_printf(b, "%s", bval ? "true" : "false");
+			break;
+		case DATA_TYPE_BOOLEAN:
+			bny_buf_put(b, "true", 4);
+			break;
+		case DATA_TYPE_NVLIST:
+			VERIFY0(nvpair_value_nvlist(pair, &nvlval));
+			bny_json_nvl(b, nvlval);
+			break;
+		default:
+			bny_buf_put(b, "null", 4);
+			break;
+		}
+	}
+	bny_buf_put(b, "}", 1);
+}
+
+/*
+ * Renders an nvlist as JSON, the same way we do for BNY_NVLIST fields in log
+ * records. Returns a NUL-terminated string the caller must free().
+ */
+char *
+bunyan_nvl_json(nvlist_t *nvl, size_t *lenp)
+{
+	struct bny_buf b;
+
+	bzero(&b, sizeof (b));
+	bny_json_nvl(&b, nvl);
+	bny_buf_put(&b, "", 1);
+	if (lenp != NULL)
+		*lenp = b.bb_len - 1;
+	return (b.bb_data);
 }
 
 void
@@ -298,44 +1060,551 @@ bunyan_set(const char *name1, enum bunyan_arg_type typ1, ...)
 		typ = va_arg(ap, enum bunyan_arg_type);
 	}
 	va_end(ap);
+
+	bunyan_base_changed();
 }
 
+/*
+ * Sets the fields that go in every record this thread logs from now until
+ * the next bunyan_thread_set() or bunyan_thread_clear(). Unlike bunyan_set(),
+ * this doesn't touch anything shared, so it's cheap enough to do per request.
+ */
 void
-bunyan_log(enum bunyan_log_level level, const char *msg, ...)
+bunyan_thread_set(const char *name1, enum bunyan_arg_type typ1, ...)
 {
-	nvlist_t *nvl, *nnvl;
-	char time[128];
+	struct bny_buf *b = &bunyan_tbuf_get()->tb_ctx;
+	const char *propname = name1;
+	enum bunyan_arg_type typ = typ1;
 	va_list ap;
-	const char *propname;
-	enum bunyan_arg_type typ;
+
+	b->bb_len = 0;
+	va_start(ap, typ1);
+	while (1) {
+		bny_json_string(b, propname);
+		bny_buf_put(b, ":", 1);
+
+		switch (typ) {
+		case BNY_STRING:
+			bny_json_string(b, va_arg(ap, const char *));
+			break;
+		case BNY_INT:
+			bny_buf_printf(b, "%d", va_arg(ap, int));
+			break;
+		case BNY_UINT:
+			bny_buf_printf(b, "%u", va_arg(ap, uint));
+			break;
+		default:
+			VERIFY(0);
+		}
+		bny_buf_put(b, ",", 1);
+
+		propname = va_arg(ap, const char *);
+		if (propname == NULL)
+			break;
+
+		typ = va_arg(ap, enum bunyan_arg_type);
+	}
+	va_end(ap);
+}
+
+void
+bunyan_thread_clear(void)
+{
+	bunyan_tbuf.tb_ctx.bb_len = 0;
+}
+
+/*
+ * Copies the base fields into this thread's buffer (re-rendering them first
+ * if they've changed since anyone last did).
+ */
+static void
+bunyan_tbuf_rebase(struct bny_tbuf *tb)
+{
+	struct bny_buf *base = &bunyan_base_json;
+	uint_t gen;
+
+	mutex_enter(&bunyan_bmutex);
+	gen = bunyan_base_gen;
+	if (bunyan_base_built != gen) {
+		if (bunyan_hostname == NULL)
+			bunyan_get_hostname();
+		base->bb_len = 0;
+		bny_json_nvl(base, bunyan_base);
+		/* Re-open the object so we can keep adding to it. */
+		VERIFY3U(base->bb_len, >=, 2);
+		base->bb_len--;
+		if (base->bb_len > 1)
+			bny_buf_put(base, ",", 1);
+		bny_buf_put(base, "\"name\":", 7);
+		bny_json_string(base,
+		    (bunyan_name != NULL) ? bunyan_name : "");
+		bny_buf_put(base, ",\"hostname\":", 12);
+		bny_json_string(base, bunyan_hostname);
+		bny_buf_printf(base, ",\"pid\":%d,", (int)getpid());
+		bunyan_base_built = gen;
+	}
+	tb->tb_buf.bb_len = 0;
+	bny_buf_put(&tb->tb_buf, base->bb_data, base->bb_len);
+	tb->tb_baselen = base->bb_len;
+	tb->tb_gen = gen;
+	mutex_exit(&bunyan_bmutex);
+}
+
+static void
+bny_json_timers(struct bny_buf *b, struct bunyan_timers *tms)
+{
+	struct timer_block *tb;
+	size_t idx;
+	uint64_t usec;
+	boolean_t first = B_TRUE;
+
+	bny_buf_put(b, "{", 1);
+	for (tb = tms->bt_first; tb != NULL; tb = tb->tb_next) {
+		for (idx = 0; idx < tb->tb_pos; ++idx) {
+			usec = tb->tb_timers[idx].tv_nsec / 1000;
+			usec += tb->tb_timers[idx].tv_sec * 1000000;
+			if (!first)
+				bny_buf_put(b, ",", 1);
+			first = B_FALSE;
+			bny_json_string(b, tb->tb_names[idx]);
+			bny_buf_printf(b, ":%llu", (unsigned long long)usec);
+		}
+	}
+	bny_buf_put(b, "}", 1);
+}
+
+/* The same as buf_to_hex(..., B_TRUE), but straight into the buffer. */
+static void
+bny_json_hex(struct bny_buf *b, const uint8_t *buf, size_t len)
+{
+	size_t i;
+	char *p;
+
+	bny_buf_reserve(b, len * 3 + 2);
+	p = &b->bb_data[b->bb_len];
+	*p++ = '"';
+	for (i = 0; i < len; ++i) {
+		*p++ = nybble_to_hex((buf[i] & 0xF0) >> 4);
+		*p++ = nybble_to_hex(buf[i] & 0x0F);
+		if (i + 1 < len)
+			*p++ = ' ';
+	}
+	*p++ = '"';
+	b->bb_len = p - b->bb_data;
+}
+
+/*
+ * In async mode (see bunyan_set_async()), bunyan_log() doesn't write records
+ * out itself: it copies them into a bounded queue, and a background thread
+ * writes them out in batches (one writev() each). That way a slow stderr
+ * (the SMF log, or a full pipe) holds up only the writer, not whoever was
+ * logging in the middle of a card operation or a signature.
+ *
+ * The queue is an array of bq_size records, reused in a circle (we keep each
+ * one's buffer around). The records between bq_tail and bq_claim are being
+ * written out right now; those between bq_claim and bq_head are waiting.
+ * Everything is protected by bq_mtx.
+ *
+ * When the queue is full, what we do depends on bq_policy: wait for the
+ * writer, drop the new record, or (the default) drop the lowest-level record
+ * out of the new one and those waiting. We count what we drop by level, and
+ * the writer logs the counts.
+ */
+#define	BQ_BATCH	64
+#define	BQ_NLEVELS	(FATAL / 10 + 1)
+
+struct bny_qrec {
+	char *qr_data;
+	size_t qr_len;
+	size_t qr_alloc;
+	enum bunyan_log_level qr_level;
+};
+
+static mutex_t bq_mtx;
+static cond_t bq_addcv;
+static cond_t bq_donecv;
+static struct bny_qrec *bq_recs = NULL;
+static uint_t bq_size;
+static uint_t bq_head, bq_claim, bq_tail;
+static boolean_t bq_running = B_FALSE;
+static boolean_t bq_busy = B_FALSE;
+static enum bunyan_overflow bq_policy = BNY_OVERFLOW_DROP_LOWEST;
+static uint64_t bq_dropped[BQ_NLEVELS];
+static uint64_t bq_reported[BQ_NLEVELS];
+
+static void
+bny_writev_all(int fd, struct iovec *iov, int niov)
+{
+	ssize_t rv;
+
+	while (niov > 0) {
+		rv = writev(fd, iov, niov);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			return;
+		while (niov > 0 && rv >= iov->iov_len) {
+			rv -= iov->iov_len;
+			++iov;
+			--niov;
+		}
+		if (niov > 0) {
+			iov->iov_base = (char *)iov->iov_base + rv;
+			iov->iov_len -= rv;
+		}
+	}
+}
+
+/*
+ * Writes out all the records that are waiting in the queue, up to BQ_BATCH at
+ * a time. Called with bq_mtx held, by the writer or by bunyan_flush(), after
+ * waiting for !bq_busy. Drops and re-takes the mutex around each write.
+ */
+static void
+bunyan_queue_write(void)
+{
+	struct iovec iov[BQ_BATCH];
+	struct bny_qrec *qr;
+	uint_t start, end, i;
+
+	while (bq_claim != bq_head) {
+		start = bq_claim;
+		end = bq_head;
+		if (end - start > BQ_BATCH)
+			end = start + BQ_BATCH;
+		for (i = start; i != end; ++i) {
+			qr = &bq_recs[i % bq_size];
+			iov[i - start].iov_base = qr->qr_data;
+			iov[i - start].iov_len = qr->qr_len;
+		}
+		bq_claim = end;
+		bq_busy = B_TRUE;
+		mutex_exit(&bq_mtx);
+
+		bny_writev_all(STDERR_FILENO, iov, end - start);
+
+		mutex_enter(&bq_mtx);
+		bq_tail = end;
+		bq_busy = B_FALSE;
+		VERIFY0(cond_broadcast(&bq_donecv));
+	}
+}
+
+static void *
+bunyan_writer(void *arg)
+{
+	uint64_t dropped[BQ_NLEVELS];
+	boolean_t report;
+	uint_t i;
+
+	mutex_enter(&bq_mtx);
+	while (1) {
+		while (bq_claim == bq_head || bq_busy)
+			(void) cond_wait(&bq_addcv, &bq_mtx);
+		bunyan_queue_write();
+
+		report = B_FALSE;
+		for (i = 0; i < BQ_NLEVELS; ++i) {
+			dropped[i] = bq_dropped[i] - bq_reported[i];
+			bq_reported[i] = bq_dropped[i];
+			if (dropped[i] > 0)
+				report = B_TRUE;
+		}
+		if (!report)
+			continue;
+		mutex_exit(&bq_mtx);
+		bunyan_log(WARN, "log queue was full, records dropped",
+		    "trace", BNY_UINT64, dropped[TRACE / 10],
+		    "debug", BNY_UINT64, dropped[DEBUG / 10],
+		    "info", BNY_UINT64, dropped[INFO / 10],
+		    "warn", BNY_UINT64, dropped[WARN / 10],
+		    "error", BNY_UINT64, dropped[ERROR / 10],
+		    NULL);
+		mutex_enter(&bq_mtx);
+	}
+	return (NULL);
+}
+
+/*
+ * Makes room for a record at the given level by dropping the lowest-level
+ * (and then oldest) record that's waiting, if there is one lower than it.
+ */
+static boolean_t
+bunyan_queue_evict(enum bunyan_log_level level)
+{
+	uint_t i, victim;
+	enum bunyan_log_level lowest = level;
+	struct bny_qrec tmp;
+
+	victim = bq_head;
+	for (i = bq_claim; i != bq_head; ++i) {
+		if (bq_recs[i % bq_size].qr_level < lowest) {
+			lowest = bq_recs[i % bq_size].qr_level;
+			victim = i;
+		}
+	}
+	if (victim == bq_head)
+		return (B_FALSE);
+
+	++bq_dropped[lowest / 10];
+	/* Shuffle the victim up to the end, keeping everyone's buffers. */
+	for (i = victim; i + 1 != bq_head; ++i) {
+		tmp = bq_recs[i % bq_size];
+		bq_recs[i % bq_size] = bq_recs[(i + 1) % bq_size];
+		bq_recs[(i + 1) % bq_size] = tmp;
+	}
+	--bq_head;
+	return (B_TRUE);
+}
+
+static void
+bunyan_queue_put(enum bunyan_log_level level, const char *data, size_t len)
+{
+	struct bny_qrec *qr;
+	char *nd;
+
+	mutex_enter(&bq_mtx);
+	if (!bq_running) {
+		VERIFY0(thr_create(NULL, 0, bunyan_writer, NULL, THR_DETACHED,
+		    NULL));
+		bq_running = B_TRUE;
+	}
+	while (bq_head - bq_tail >= bq_size) {
+		if (bq_policy == BNY_OVERFLOW_BLOCK) {
+			(void) cond_wait(&bq_donecv, &bq_mtx);
+			continue;
+		}
+		if (bq_policy == BNY_OVERFLOW_DROP_LOWEST &&
+		    bunyan_queue_evict(level)) {
+			break;
+		}
+		++bq_dropped[level / 10];
+		mutex_exit(&bq_mtx);
+		return;
+	}
+
+	qr = &bq_recs[bq_head % bq_size];
+	if (qr->qr_alloc < len) {
+		nd = realloc(qr->qr_data, len);
+		VERIFY(nd != NULL);
+		qr->qr_data = nd;
+		qr->qr_alloc = len;
+	}
+	bcopy(data, qr->qr_data, len);
+	qr->qr_len = len;
+	qr->qr_level = level;
+	++bq_head;
+	VERIFY0(cond_signal(&bq_addcv));
+	mutex_exit(&bq_mtx);
+}
+
+/*
+ * Writes out everything in the async queue before returning (if we're in
+ * async mode at all). Used before we exit or abort.
+ */
+void
+bunyan_flush(void)
+{
+	if (bq_recs == NULL)
+		return;
+	mutex_enter(&bq_mtx);
+	while (bq_busy)
+		(void) cond_wait(&bq_donecv, &bq_mtx);
+	bunyan_queue_write();
+	mutex_exit(&bq_mtx);
+}
+
+static void
+bunyan_queue_prefork(void)
+{
+	mutex_enter(&bq_mtx);
+}
+
+static void
+bunyan_queue_postfork_parent(void)
+{
+	mutex_exit(&bq_mtx);
+}
+
+/*
+ * The writer thread doesn't come with us into a child, and the parent will
+ * write out what's already queued, so start again empty.
+ */
+static void
+bunyan_queue_postfork_child(void)
+{
+	bq_head = bq_claim = bq_tail = 0;
+	bq_busy = B_FALSE;
+	bq_running = B_FALSE;
+	mutex_exit(&bq_mtx);
+}
+
+/*
+ * Switches on async mode, with a queue of qlen records. Should be called
+ * once, early (before any other threads are logging).
+ */
+void
+bunyan_set_async(uint_t qlen, enum bunyan_overflow policy)
+{
+	VERIFY3P(bq_recs, ==, NULL);
+	VERIFY3U(qlen, >, 0);
+	VERIFY0(mutex_init(&bq_mtx, USYNC_THREAD | LOCK_ERRORCHECK, NULL));
+	VERIFY0(cond_init(&bq_addcv, USYNC_THREAD, NULL));
+	VERIFY0(cond_init(&bq_donecv, USYNC_THREAD, NULL));
+	bq_policy = policy;
+	bq_size = qlen;
+	bq_recs = calloc(qlen, sizeof (struct bny_qrec));
+	VERIFY(bq_recs != NULL);
+	VERIFY0(pthread_atfork(bunyan_queue_prefork,
+	    bunyan_queue_postfork_parent, bunyan_queue_postfork_child));
+	VERIFY0(atexit(bunyan_flush));
+}
+
+/*
+ * Sampling and rate limits for busy log call sites (bunyan_set_limits()).
+ * These only ever apply to records below BNY_LIMIT_LEVEL: we don't want to
+ * lose warnings or errors.
+ *
+ * Every bunyan_log() call site has its own struct bunyan_site (see the macro
+ * in bunyan.h). With sampling on, we keep only one in every bunyan_sample
+ * records from each site; with a rate limit, at most bunyan_rate records per
+ * second from each site. The counters are updated without a lock, so the
+ * limits are approximate when several threads log from one site at once.
+ *
+ * Sites that have suppressed anything are on the bunyan_sites list, and every
+ * BNY_SUPPRESS_REPORT_SEC we log how many records each one has suppressed.
+ */
+#define	BNY_LIMIT_LEVEL		WARN
+#define	BNY_SUPPRESS_REPORT_SEC	10
+
+static uint_t bunyan_sample = 1;
+static uint_t bunyan_rate = 0;
+static struct bunyan_site *bunyan_sites = NULL;
+static volatile uint32_t bunyan_last_report = 0;
+
+void
+bunyan_set_limits(uint_t sample, uint_t rate)
+{
+	bunyan_sample = (sample > 0) ? sample : 1;
+	bunyan_rate = rate;
+}
+
+/* Returns B_TRUE if this record from this site should be suppressed. */
+static boolean_t
+bunyan_site_suppress(struct bunyan_site *bs, const char *msg, uint32_t sec)
+{
+	uint32_t win;
+
+	if (bunyan_sample > 1 &&
+	    (atomic_inc_32_nv(&bs->bs_seen) - 1) % bunyan_sample != 0) {
+		goto suppress;
+	}
+	if (bunyan_rate > 0) {
+		win = bs->bs_window;
+		if (win != sec && atomic_cas_32(&bs->bs_window, win, sec) ==
+		    win) {
+			bs->bs_count = 0;
+		}
+		if (atomic_inc_32_nv(&bs->bs_count) > bunyan_rate)
+			goto suppress;
+	}
+	return (B_FALSE);
+
+suppress:
+	bs->bs_msg = msg;
+	atomic_inc_32(&bs->bs_suppressed);
+	if (atomic_cas_32(&bs->bs_listed, 0, 1) == 0) {
+		mutex_enter(&bunyan_bmutex);
+		bs->bs_next = bunyan_sites;
+		bunyan_sites = bs;
+		mutex_exit(&bunyan_bmutex);
+	}
+	return (B_TRUE);
+}
+
+/*
+ * Logs a summary for each site that has suppressed records since the last
+ * time we did this. Whoever logs first after BNY_SUPPRESS_REPORT_SEC gets to
+ * do it.
+ */
+static void
+bunyan_report_suppressed(uint32_t sec)
+{
+	struct bunyan_site *bs;
+	uint32_t last = bunyan_last_report;
+	uint32_t n;
+
+	if (sec - last < BNY_SUPPRESS_REPORT_SEC ||
+	    atomic_cas_32(&bunyan_last_report, last, sec) != last) {
+		return;
+	}
 
 	mutex_enter(&bunyan_bmutex);
-	VERIFY0(nvlist_dup(bunyan_base, &nvl, 0));
-	VERIFY0(nvlist_add_int32(nvl, "level", level));
-	VERIFY0(nvlist_add_string(nvl, "name", bunyan_name));
-	if (bunyan_hostname == NULL)
-		bunyan_get_hostname();
-	VERIFY0(nvlist_add_string(nvl, "hostname", bunyan_hostname));
+	bs = bunyan_sites;
 	mutex_exit(&bunyan_bmutex);
 
-	VERIFY0(nvlist_add_int32(nvl, "pid", getpid()));
+	/* Sites only ever get added to the front, so this walk is safe. */
+	for (; bs != NULL; bs = bs->bs_next) {
+		n = atomic_swap_32(&bs->bs_suppressed, 0);
+		if (n == 0)
+			continue;
+		bunyan_log_emit(NULL, INFO, "log messages suppressed",
+		    "suppressed", BNY_UINT, n,
+		    "site_file", BNY_STRING, bs->bs_file,
+		    "site_line", BNY_INT, bs->bs_line,
+		    "site_msg", BNY_STRING, bs->bs_msg,
+		    "period_sec", BNY_INT, BNY_SUPPRESS_REPORT_SEC,
+		    NULL);
+	}
+}
 
-	bunyan_timestamp(time, sizeof (time));
-	VERIFY0(nvlist_add_string(nvl, "time", time));
+/*
+ * Normally called via the bunyan_log() macro, which has already checked the
+ * level, and gives us its call site (for sampling and rate limits). We check
+ * the level again here for anyone calling us directly.
+ */
+void
+bunyan_log_emit(struct bunyan_site *site, enum bunyan_log_level level,
+    const char *msg, ...)
+{
+	struct bny_tbuf *tb = bunyan_tbuf_get();
+	struct bny_buf *b = &tb->tb_buf;
+	char time[32];
+	va_list ap;
+	const char *propname;
+	enum bunyan_arg_type typ;
+	size_t off;
+	ssize_t rv;
+	uint64_t now;
+	boolean_t limits;
+
+	if (level < bunyan_min_level)
+		return;
+
+	now = bunyan_now_ms();
+	limits = (bunyan_sample > 1 || bunyan_rate > 0);
+	if (limits && site != NULL && level < BNY_LIMIT_LEVEL &&
+	    bunyan_site_suppress(site, msg, now / 1000)) {
+		return;
+	}
+	if (limits && bunyan_sites != NULL)
+		bunyan_report_suppressed(now / 1000);
+
+	if (tb->tb_gen != bunyan_base_gen)
+		bunyan_tbuf_rebase(tb);
+	b->bb_len = tb->tb_baselen;
+	if (tb->tb_ctx.bb_len > 0)
+		bny_buf_put(b, tb->tb_ctx.bb_data, tb->tb_ctx.bb_len);
 
-	VERIFY0(nvlist_add_string(nvl, "msg", msg));
+	bunyan_timestamp(time, now);
+	bny_buf_printf(b, "\"level\":%d,\"time\":\"%s\",\"msg\":",
+	    level, time);
+	bny_json_string(b, msg);
 
 	va_start(ap, msg);
 	while (1) {
-		const char *strval;
-		char *wstrval;
 		const uint8_t *binval;
-		int intval;
-		uint uintval;
-		uint64_t uint64val;
 		size_t szval;
-		nvlist_t *nvlval;
-		struct bunyan_timers *tsval;
 
 		propname = va_arg(ap, const char *);
 		if (propname == NULL)
@@ -343,44 +1612,38 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 
 		typ = va_arg(ap, enum bunyan_arg_type);
 
+		bny_buf_put(b, ",", 1);
+		bny_json_string(b, propname);
+		bny_buf_put(b, ":", 1);
+
 		switch (typ) {
 		case BNY_STRING:
-			strval = va_arg(ap, const char *);
-			VERIFY0(nvlist_add_string(nvl, propname, strval));
+			bny_json_string(b, va_arg(ap, const char *));
 			break;
 		case BNY_INT:
-			intval = va_arg(ap, int);
-			VERIFY0(nvlist_add_int32(nvl, propname, intval));
+			bny_buf_printf(b, "%d", va_arg(ap, int));
 			break;
 		case BNY_UINT:
-			uintval = va_arg(ap, uint);
-			VERIFY0(nvlist_add_uint32(nvl, propname, uintval));
+			bny_buf_printf(b, "%u", va_arg(ap, uint));
 			break;
 		case BNY_UINT64:
-			uint64val = va_arg(ap, uint64_t);
-			VERIFY0(nvlist_add_uint64(nvl, propname, uint64val));
+			bny_buf_printf(b, "%llu",
+			    (unsigned long long)va_arg(ap, uint64_t));
 			break;
 		case BNY_SIZE_T:
-			szval = va_arg(ap, size_t);
-			VERIFY0(nvlist_add_uint64(nvl, propname, szval));
+			bny_buf_printf(b, "%llu",
+			    (unsigned long long)va_arg(ap, size_t));
 			break;
 		case BNY_NVLIST:
-			nvlval = va_arg(ap, nvlist_t *);
-			VERIFY0(nvlist_add_nvlist(nvl, propname, nvlval));
+			bny_json_nvl(b, va_arg(ap, nvlist_t *));
 			break;
 		case BNY_TIMERS:
-			tsval = va_arg(ap, struct bunyan_timers *);
-			VERIFY0(nvlist_alloc(&nnvl, NV_UNIQUE_NAME, 0));
-			VERIFY0(bny_timers_to_nvl(tsval, nnvl));
-			VERIFY0(nvlist_add_nvlist(nvl, propname, nnvl));
-			nvlist_free(nnvl);
+			bny_json_timers(b, va_arg(ap, struct bunyan_timers *));
 			break;
 		case BNY_BIN_HEX:
 			binval = va_arg(ap, const uint8_t *);
 			szval = va_arg(ap, size_t);
-			wstrval = buf_to_hex(binval, szval, B_TRUE);
-			VERIFY0(nvlist_add_string(nvl, propname, wstrval));
-			free(wstrval);
+			bny_json_hex(b, binval, szval);
 			break;
 		default:
 			VERIFY(0);
@@ -388,17 +1651,31 @@ bunyan_log(enum bunyan_log_level level, const char *msg, ...)
 	}
 	va_end(ap);
 
-	mutex_enter(&bunyan_bmutex);
-	if (level < bunyan_min_level) {
-		nvlist_free(nvl);
-		mutex_exit(&bunyan_bmutex);
+	bny_buf_put(b, "}\n", 2);
+
+	if (bunyan_ring_producer) {
+		bunyan_ring_put(b->bb_data, b->bb_len);
 		return;
 	}
-	mutex_exit(&bunyan_bmutex);
 
-	mutex_enter(bunyan_wrmutex);
-	nvlist_print_json(stderr, nvl);
-	fprintf(stderr, "\n");
-	mutex_exit(bunyan_wrmutex);
-	nvlist_free(nvl);
+	if (bq_recs != NULL) {
+		bunyan_queue_put(level, b->bb_data, b->bb_len);
+		if (level >= FATAL)
+			bunyan_flush();
+		return;
+	}
+
+	/*
+	 * One write() per record keeps records from different threads (and
+	 * processes) from being mixed up, as long as they're not huge.
+	 */
+	off = 0;
+	while (off < b->bb_len) {
+		rv = write(STDERR_FILENO, b->bb_data + off, b->bb_len - off);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			break;
+		off += rv;
+	}
 }
@@ -19,6 +19,13 @@ enum bunyan_log_level {
 	FATAL = 60
 };
 
+/* What to do when the async log queue is full (see bunyan_set_async()). */
+enum bunyan_overflow {
+	BNY_OVERFLOW_DROP_LOWEST,
+	BNY_OVERFLOW_DROP_NEW,
+	BNY_OVERFLOW_BLOCK
+};
+
 enum bunyan_arg_type {
 	BNY_STRING,
 	BNY_INT,
@@ -34,12 +41,64 @@ void bunyan_init(void);
 void bunyan_unshare(void);
 void bunyan_set_name(const char *name);
 void bunyan_set_level(enum bunyan_log_level level);
-void bunyan_log(enum bunyan_log_level level, const char *msg, ...);
+void bunyan_set_coarse_clock(boolean_t coarse);
+
+/*
+ * State kept for each bunyan_log() call site, for sampling and rate limits
+ * (see bunyan_set_limits()).
+ */
+struct bunyan_site {
+	const char *bs_file;
+	int bs_line;
+	volatile uint32_t bs_seen;
+	volatile uint32_t bs_window;
+	volatile uint32_t bs_count;
+	volatile uint32_t bs_suppressed;
+	volatile uint32_t bs_listed;
+	const char *bs_msg;
+	struct bunyan_site *bs_next;
+};
+
+void bunyan_log_emit(struct bunyan_site *site, enum bunyan_log_level level,
+    const char *msg, ...);
+void bunyan_set_limits(uint_t sample, uint_t rate);
 void bunyan_set(const char *name1, enum bunyan_arg_type typ1, ...);
+void bunyan_thread_set(const char *name1, enum bunyan_arg_type typ1, ...);
+void bunyan_thread_clear(void);
+void bunyan_set_async(uint_t qlen, enum bunyan_overflow policy);
+void bunyan_flush(void);
+
+void bunyan_ring_create(void);
+void bunyan_ring_produce(int wakefd);
+void bunyan_ring_drain(int fd);
 
 struct bunyan_timers *bny_timers_new(void);
 int bny_timer_begin(struct bunyan_timers *tms);
 int bny_timer_next(struct bunyan_timers *tms, const char *name);
 void bny_timers_free(struct bunyan_timers *tms);
 
+void bny_timers_record(struct bunyan_timers *tms, const char *prefix);
+void bny_hist_add(const char *prefix, const char *phase, uint64_t usec);
+void bunyan_hist_init(uint_t interval_sec);
+void bunyan_hist_tick(void);
+void bunyan_hist_nvl(nvlist_t *nvl);
+
+char *bunyan_nvl_json(nvlist_t *nvl, size_t *lenp);
+
+/*
+ * Log lines below bunyan_min_level are dropped before any of the arguments
+ * are even evaluated (some of them, like BNY_BIN_HEX buffers of APDUs, are
+ * expensive to build), so a filtered-out bunyan_log() costs just one load.
+ */
+extern volatile enum bunyan_log_level bunyan_min_level;
+
+#define	bunyan_log(level, ...)	do {					\
+		static struct bunyan_site bny_site_ =			\
+		    { __FILE__, __LINE__ };				\
+		if ((level) >= bunyan_min_level) {			\
+			bunyan_log_emit(&bny_site_, (level),		\
+			    __VA_ARGS__);				\
+		}							\
+	} while (0)
+
 #endif
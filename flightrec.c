@@ -0,0 +1,369 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2017, Joyent Inc
+ * Author: Alex Wilson <alex.wilson@joyent.com>
+ */
+
+/*
+ * The flight recorder: a fixed-size ring of the last FR_NENTS events in this
+ * process (APDUs, control commands and requests, slot state changes, client
+ * requests), which is always on and cheap enough to stay that way. Each event
+ * is a type, a timestamp, the thread ID and up to four integers.
+ *
+ * Writers don't take any locks: each one claims a sequence number with an
+ * atomic increment, and writes the event into that slot of the ring, setting
+ * fe_seq last. A reader only trusts an entry if its fe_seq is the one it
+ * expected, both before and after copying it out.
+ *
+ * The ring gets written out as one bunyan-format record when we die on a
+ * SIGABRT (a failed VERIFY, or supervisor_panic(), which also sends one to the
+ * agent), or on demand with SIGUSR2. Since that happens in a signal handler,
+ * the dump code only uses async-signal-safe calls and formats everything by
+ * hand into a static buffer rather than going through bunyan.c.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <thread.h>
+#include <atomic.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include <sys/debug.h>
+
+#include "flightrec.h"
+
+struct fr_event {
+	volatile uint64_t fe_seq;	/* 0 while it's being written */
+	hrtime_t fe_time;
+	uint32_t fe_tid;
+	uint16_t fe_type;
+	uint16_t fe_pad;
+	uint32_t fe_args[4];
+};
+
+static struct fr_event fr_ring[FR_NENTS];
+static volatile uint64_t fr_next = 0;
+static volatile uint_t fr_dumping = 0;
+
+static const char *fr_name = "unknown";
+static char fr_host[MAXHOSTNAMELEN] = "unknown";
+
+/* Enough for the record header plus FR_MAX_EVENT for each event. */
+#define	FR_MAX_EVENT	128
+static char fr_buf[1024 + FR_NENTS * FR_MAX_EVENT];
+
+/*
+ * How to print each type of event: its name, the names of its arguments (NULL
+ * after the last one), and which of them (as a bitmask) are in hex.
+ */
+static const struct fr_format {
+	const char *ff_name;
+	const char *ff_args[4];
+	uint_t ff_hex;
+} fr_formats[FR_TYPE_MAX] = {
+	[FR_APDU_SEND] = { "apdu_send", { "cla", "ins", "p1p2", "len" }, 0x7 },
+	[FR_APDU_RECV] = { "apdu_recv", { "ins", "rv", "sw", "len" }, 0x7 },
+	[FR_CMD_SEND] = { "cmd_send", { "type", "cookie", "p1" }, 0 },
+	[FR_CMD_RECV] = { "cmd_recv", { "type", "cookie", "p1" }, 0 },
+	[FR_REQ_PUT] = { "req_put", { "type", "id", "slot", "status" }, 0x2 },
+	[FR_REQ_GET] = { "req_get", { "type", "id", "slot", "status" }, 0x2 },
+	[FR_SLOT_STATE] = { "slot_state", { "slot", "from", "to" }, 0 },
+	[FR_CLIENT_REQ] = { "client_req", { "fd", "type", "pid" }, 0 },
+	[FR_CLIENT_ACCEPT] = { "client_accept", { "fd", "pid", "euid" }, 0 },
+	[FR_CLIENT_CLOSE] = { "client_close", { "fd" }, 0 }
+};
+
+void
+fr_record(enum fr_type type, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	struct fr_event *e;
+	uint64_t seq;
+
+	seq = atomic_inc_64_nv(&fr_next);
+	e = &fr_ring[(seq - 1) % FR_NENTS];
+	e->fe_seq = 0;
+	membar_producer();
+	e->fe_time = gethrtime();
+	e->fe_tid = thr_self();
+	e->fe_type = type;
+	e->fe_args[0] = a;
+	e->fe_args[1] = b;
+	e->fe_args[2] = c;
+	e->fe_args[3] = d;
+	membar_producer();
+	e->fe_seq = seq;
+}
+
+/*
+ * Everything from here down has to be safe to call from a signal handler: no
+ * malloc, no stdio, no locks.
+ */
+struct fr_out {
+	char *fo_p;
+	char *fo_end;
+};
+
+static void
+fr_putc(struct fr_out *o, char c)
+{
+	if (o->fo_p < o->fo_end)
+		*o->fo_p++ = c;
+}
+
+static void
+fr_puts(struct fr_out *o, const char *s)
+{
+	while (*s != '\0')
+		fr_putc(o, *s++);
+}
+
+/* Puts a string in double quotes, escaping anything JSON wouldn't like. */
+static void
+fr_putjs(struct fr_out *o, const char *s)
+{
+	fr_putc(o, '"');
+	for (; *s != '\0'; ++s) {
+		if (*s == '"' || *s == '\\')
+			fr_putc(o, '\\');
+		if ((uchar_t)*s < 0x20)
+			fr_putc(o, '?');
+		else
+			fr_putc(o, *s);
+	}
+	fr_putc(o, '"');
+}
+
+static void
+fr_putu(struct fr_out *o, uint64_t v, uint_t base, uint_t width)
+{
+	char tmp[24];
+	uint_t n = 0;
+
+	do {
+		tmp[n++] = "0123456789abcdef"[v % base];
+		v /= base;
+	} while (v > 0 && n < sizeof (tmp));
+	while (n < width && n < sizeof (tmp))
+		tmp[n++] = '0';
+	while (n > 0)
+		fr_putc(o, tmp[--n]);
+}
+
+/* Formats a time as "YYYY-MM-DDTHH:MM:SS.mmmZ", without gmtime(). */
+static void
+fr_puttime(struct fr_out *o, const struct timespec *ts)
+{
+	int64_t days, z, era, y;
+	uint64_t secs, doe, yoe, doy, mp, m, d;
+
+	days = ts->tv_sec / 86400;
+	secs = ts->tv_sec % 86400;
+
+	/* See Howard Hinnant's "civil_from_days" algorithm. */
+	z = days + 719468;
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	y = yoe + era * 400;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	d = doy - (153 * mp + 2) / 5 + 1;
+	m = (mp < 10) ? mp + 3 : mp - 9;
+	if (m <= 2)
+		++y;
+
+	fr_putu(o, y, 10, 4);
+	fr_putc(o, '-');
+	fr_putu(o, m, 10, 2);
+	fr_putc(o, '-');
+	fr_putu(o, d, 10, 2);
+	fr_putc(o, 'T');
+	fr_putu(o, secs / 3600, 10, 2);
+	fr_putc(o, ':');
+	fr_putu(o, (secs / 60) % 60, 10, 2);
+	fr_putc(o, ':');
+	fr_putu(o, secs % 60, 10, 2);
+	fr_putc(o, '.');
+	fr_putu(o, ts->tv_nsec / 1000000, 10, 3);
+	fr_putc(o, 'Z');
+}
+
+/*
+ * Each event becomes a string like:
+ *	"-12.345ms t5 apdu_recv ins=87 rv=0 sw=9000 len=42"
+ * where the time is how long before the dump it happened.
+ */
+static void
+fr_putevent(struct fr_out *o, const struct fr_event *e, hrtime_t now)
+{
+	const struct fr_format *ff = NULL;
+	uint64_t age;
+	uint_t i;
+
+	if (e->fe_type < FR_TYPE_MAX)
+		ff = &fr_formats[e->fe_type];
+
+	age = (now > e->fe_time) ? (now - e->fe_time) / 1000 : 0;
+	fr_putc(o, '"');
+	fr_putc(o, '-');
+	fr_putu(o, age / 1000, 10, 1);
+	fr_putc(o, '.');
+	fr_putu(o, age % 1000, 10, 3);
+	fr_puts(o, "ms t");
+	fr_putu(o, e->fe_tid, 10, 1);
+	fr_putc(o, ' ');
+	if (ff == NULL || ff->ff_name == NULL) {
+		fr_puts(o, "type");
+		fr_putu(o, e->fe_type, 10, 1);
+		ff = NULL;
+	} else {
+		fr_puts(o, ff->ff_name);
+	}
+	for (i = 0; i < 4; ++i) {
+		if (ff != NULL && ff->ff_args[i] == NULL)
+			break;
+		fr_putc(o, ' ');
+		if (ff != NULL)
+			fr_puts(o, ff->ff_args[i]);
+		else
+			fr_putu(o, i, 10, 1);
+		fr_putc(o, '=');
+		if (ff != NULL && (ff->ff_hex & (1 << i)))
+			fr_putu(o, e->fe_args[i], 16,
+			    (e->fe_args[i] > 0xff) ? 4 : 2);
+		else
+			fr_putu(o, e->fe_args[i], 10, 1);
+	}
+	fr_putc(o, '"');
+}
+
+void
+fr_dump(int fd, int level, const char *why)
+{
+	struct fr_out o;
+	struct fr_event e;
+	struct timespec ts;
+	hrtime_t now;
+	uint64_t seq, first, last;
+	boolean_t any = B_FALSE;
+	ssize_t rv;
+	char *p;
+
+	/* Only one dump at a time: we've only got one buffer. */
+	if (atomic_cas_uint(&fr_dumping, 0, 1) != 0)
+		return;
+
+	now = gethrtime();
+	(void) clock_gettime(CLOCK_REALTIME, &ts);
+
+	o.fo_p = fr_buf;
+	/* Leave room to close off the record, whatever happens. */
+	o.fo_end = fr_buf + sizeof (fr_buf) - 4;
+
+	fr_puts(&o, "{\"v\":1,\"name\":");
+	fr_putjs(&o, fr_name);
+	fr_puts(&o, ",\"hostname\":");
+	fr_putjs(&o, fr_host);
+	fr_puts(&o, ",\"pid\":");
+	fr_putu(&o, getpid(), 10, 1);
+	fr_puts(&o, ",\"level\":");
+	fr_putu(&o, level, 10, 1);
+	fr_puts(&o, ",\"time\":\"");
+	fr_puttime(&o, &ts);
+	fr_puts(&o, "\",\"msg\":\"flight recorder\",\"why\":");
+	fr_putjs(&o, why);
+	fr_puts(&o, ",\"events\":[");
+
+	last = fr_next;
+	membar_consumer();
+	first = (last > FR_NENTS) ? last - FR_NENTS + 1 : 1;
+	for (seq = first; seq <= last; ++seq) {
+		struct fr_event *ep = &fr_ring[(seq - 1) % FR_NENTS];
+
+		if (ep->fe_seq != seq)
+			continue;
+		membar_consumer();
+		bcopy((const void *)ep, &e, sizeof (e));
+		membar_consumer();
+		if (ep->fe_seq != seq)
+			continue;
+		if (any)
+			fr_putc(&o, ',');
+		any = B_TRUE;
+		fr_putevent(&o, &e, now);
+	}
+
+	o.fo_end += 4;
+	fr_puts(&o, "]}\n");
+
+	for (p = fr_buf; p < o.fo_p; p += rv) {
+		rv = write(fd, p, o.fo_p - p);
+		if (rv == -1 && errno == EINTR) {
+			rv = 0;
+			continue;
+		}
+		if (rv <= 0)
+			break;
+	}
+
+	membar_exit();
+	fr_dumping = 0;
+}
+
+static void
+fr_sigabrt(int sig)
+{
+	/*
+	 * SA_RESETHAND has already put SIGABRT back to the default, so once
+	 * we've written out the recorder, raising it again kills us (with a
+	 * core) as it would have anyway.
+	 */
+	fr_dump(STDERR_FILENO, 60, "abort");
+	(void) raise(SIGABRT);
+}
+
+static void
+fr_sigusr2(int sig)
+{
+	fr_dump(STDERR_FILENO, 30, "SIGUSR2");
+}
+
+void
+fr_set_name(const char *name)
+{
+	fr_name = name;
+	fr_next = 0;
+	bzero(fr_ring, sizeof (fr_ring));
+	membar_producer();
+}
+
+void
+fr_init(const char *name)
+{
+	struct sigaction sa;
+
+	(void) gethostname(fr_host, sizeof (fr_host));
+	fr_host[sizeof (fr_host) - 1] = '\0';
+	fr_set_name(name);
+
+	bzero(&sa, sizeof (sa));
+	sa.sa_handler = fr_sigabrt;
+	sa.sa_flags = SA_RESETHAND;
+	VERIFY0(sigaction(SIGABRT, &sa, NULL));
+
+	bzero(&sa, sizeof (sa));
+	sa.sa_handler = fr_sigusr2;
+	sa.sa_flags = SA_RESTART;
+	VERIFY0(sigaction(SIGUSR2, &sa, NULL));
+}
@@ -0,0 +1,55 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ * Copyright (c) 2017, Joyent Inc
+ * Author: Alex Wilson <alex.wilson@joyent.com>
+ */
+
+#if !defined(_FLIGHTREC_H)
+#define _FLIGHTREC_H
+
+#include <stdint.h>
+
+/*
+ * The flight recorder keeps the last FR_NENTS interesting events in each
+ * process, so that we have some context in the log when we panic without
+ * having to run at TRACE level all the time. See flightrec.c.
+ *
+ * Events only ever carry a few small integers: never put anything derived
+ * from key material in one.
+ */
+#define	FR_NENTS	256
+
+enum fr_type {
+	FR_APDU_SEND = 1,	/* cla, ins, p1 << 8 | p2, command length */
+	FR_APDU_RECV,		/* ins, PCSC rv, sw, reply length */
+	FR_CMD_SEND,		/* ctl_cmd: type, cookie, p1 */
+	FR_CMD_RECV,		/* ctl_cmd: type, cookie, p1 */
+	FR_REQ_PUT,		/* ctl_req onto ring: type, id, slot, status */
+	FR_REQ_GET,		/* ctl_req off ring: type, id, slot, status */
+	FR_SLOT_STATE,		/* slot ID, old state, new state */
+	FR_CLIENT_REQ,		/* fd, message type, client pid */
+	FR_CLIENT_ACCEPT,	/* fd, client pid, client euid */
+	FR_CLIENT_CLOSE,	/* fd */
+
+	FR_TYPE_MAX
+};
+
+void fr_record(enum fr_type type, uint32_t a, uint32_t b, uint32_t c,
+    uint32_t d);
+
+/*
+ * fr_init() installs handlers to dump the recorder on SIGABRT (so, on a failed
+ * VERIFY or supervisor_panic()) and on SIGUSR2. Children inherit them, and
+ * should call fr_set_name() once they've forked, which also forgets the
+ * events recorded by the parent.
+ */
+void fr_init(const char *name);
+void fr_set_name(const char *name);
+
+/* Writes the recorder out to fd as one bunyan-format log record. */
+void fr_dump(int fd, int level, const char *why);
+
+#endif
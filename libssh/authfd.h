@@ -73,6 +73,10 @@ int	ssh_agent_get_x509(int sock, const struct sshkey *key,
 #define SSH2_AGENTC_ADD_ID_CONSTRAINED		25
 #define SSH_AGENTC_ADD_SMARTCARD_KEY_CONSTRAINED 26
 
+/* generic extension mechanism */
+#define SSH_AGENTC_EXTENSION			27
+#define SSH_AGENT_EXTENSION_FAILURE		28
+
 #define SSH2_AGENTC_REQUEST_X509		250
 #define SSH2_AGENT_X509_RESPONSE		251
 #define SSH2_AGENTC_REQUEST_ECDH		252
@@ -47,6 +47,8 @@
 #include "tlv.h"
 #include "piv.h"
 #include "bunyan.h"
+#include "softtoken_provider.h"
+#include "flightrec.h"
 
 #define	PIV_STATE_SHM_ID		0x50495600
 #define PIV_STATE_SHM_MAX_SIZE		(1*1024*1024)
@@ -754,6 +756,7 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 	boolean_t freedata = B_FALSE;
 	DWORD recvLength;
 	uint8_t *cmd;
+	uint16_t sw = 0;
 	struct apdubuf *r = &(apdu->a_reply);
 
 	assert(key->pt_intxn == B_TRUE);
@@ -776,11 +779,24 @@ piv_apdu_transceive(struct piv_token *key, struct apdu *apdu)
 	    "apdu", BNY_BIN_HEX, cmd, cmdLen,
 	    NULL);
 
+	SOFTTOKEN_APDU_SEND((char *)key->pt_rdrname, apdu->a_cls, apdu->a_ins,
+	    apdu->a_p1, apdu->a_p2, cmdLen);
+	fr_record(FR_APDU_SEND, apdu->a_cls, apdu->a_ins,
+	    (apdu->a_p1 << 8) | apdu->a_p2, cmdLen);
+
 	rv = SCardTransmit(key->pt_cardhdl, &key->pt_sendpci, cmd,
 	    cmdLen, NULL, r->b_data + r->b_offset, &recvLength);
 	explicit_bzero(cmd, cmdLen);
 	free(cmd);
 
+	if (rv == SCARD_S_SUCCESS && recvLength >= 2) {
+		sw = (r->b_data[r->b_offset + recvLength - 2] << 8) |
+		    r->b_data[r->b_offset + recvLength - 1];
+	}
+	SOFTTOKEN_APDU_RECV((char *)key->pt_rdrname, apdu->a_ins, rv, sw,
+	    recvLength);
+	fr_record(FR_APDU_RECV, apdu->a_ins, rv, sw, recvLength);
+
 	bunyan_log(TRACE, "received APDU",
 	    "apdu", BNY_BIN_HEX, r->b_data + r->b_offset, (size_t)recvLength,
 	    NULL);
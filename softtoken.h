@@ -19,6 +19,9 @@
 #define	TOKEN_SOCKET_PATH	TOKEN_SOCKET_DIR "/token.sock"
 #define	TOKEN_KEYS_DIR		"/zones/%s/keys"
 
+/* Default backlog on a zone's listen socket (TOKEN_LISTEN_BACKLOG). */
+#define	DEFAULT_LISTEN_BACKLOG	128
+
 #define	MAX_LOG_LINE	(4*1024)
 
 #define	MAX_CERT_LEN	(8*1024)
@@ -45,7 +48,9 @@ enum ctl_cmd_type {
 	CMD_UNLOCK_KEY,
 	CMD_LOCK_KEY,
 	CMD_SHUTDOWN,
-	CMD_RENEW_CERT
+	CMD_RENEW_CERT,
+	CMD_RING,	/* doorbell: look at the ctl_rings */
+	CMD_STARTED	/* supervisor -> manager: agent is up */
 };
 
 enum ctl_cmd_status {
@@ -59,6 +64,39 @@ struct ctl_cmd {
 	uint8_t cc_p1;
 };
 
+/*
+ * Key unlock/lock and cert renew requests from the agent, and the supervisor's
+ * replies to them, don't go over the pipe between the two processes: they go
+ * through a pair of single-producer, single-consumer rings in a shared page.
+ * The pipe only carries CMD_RING doorbells (one per batch of entries) and
+ * CMD_SHUTDOWN. (The supervisor's pipe to the manager also carries one
+ * CMD_STARTED, once the agent has been forked and the tokens enumerated.)
+ *
+ * Requests and their replies are matched up by cr_id. The agent makes these
+ * out of the slot ID (low 8 bits) and a sequence number, so it can find the
+ * slot a reply is for without searching.
+ */
+#define	CTL_RING_SIZE	64	/* entries per ring, must be a power of 2 */
+
+struct ctl_req {
+	uint32_t cr_id;
+	uint8_t cr_type;	/* enum ctl_cmd_type */
+	uint8_t cr_slot;	/* ts_id */
+	uint8_t cr_status;	/* enum ctl_cmd_status, in replies */
+	uint8_t cr_pad;
+};
+
+struct ctl_ring {
+	volatile uint32_t cr_head;	/* written only by the producer */
+	volatile uint32_t cr_tail;	/* written only by the consumer */
+	struct ctl_req cr_ents[CTL_RING_SIZE];
+};
+
+struct ctl_rings {
+	struct ctl_ring cr_sq;		/* agent -> supervisor */
+	struct ctl_ring cr_cq;		/* supervisor -> agent */
+};
+
 struct token_slot {
 	uint8_t ts_id;
 	enum slot_type ts_type;
@@ -81,13 +119,22 @@ struct token_slot_data {
 
 extern size_t slot_n;
 extern struct token_slot *token_slots;
+/* Bumped by the supervisor whenever it rewrites any ts_certdata/chaindata. */
+extern volatile uint32_t *token_cert_gen;
+extern struct ctl_rings *token_ctl_rings;
 
-void supervisor_main(zoneid_t zid, int ctlfd);
+void supervisor_main(zoneid_t zid, int ctlfd, int listensock,
+    nvlist_t *zinfo);
 void agent_main(zoneid_t zid, nvlist_t *zinfo, int listensock, int ctlfd);
 
 int read_cmd(int fd, struct ctl_cmd *cmd);
 int write_cmd(int fd, const struct ctl_cmd *cmd);
+int ring_doorbell(int fd);
+
+int ctl_ring_put(struct ctl_ring *r, const struct ctl_req *req);
+int ctl_ring_get(struct ctl_ring *r, struct ctl_req *req);
 
 void unshare_code(void);
+uint env_uint(const char *name, uint def);
 
 #endif
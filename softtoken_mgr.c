@@ -20,46 +20,294 @@
 #include <thread.h>
 #include <strings.h>
 #include <signal.h>
+#include <atomic.h>
+#include <port.h>
+#include <poll.h>
 
 #include <zone.h>
 #include <libsysevent.h>
 #include <libnvpair.h>
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/fork.h>
 #include <sys/wait.h>
 #include <sys/debug.h>
 
 #include "bunyan.h"
 #include "softtoken.h"
+#include "flightrec.h"
+#include "json.h"
+
+/*
+ * Supervisors aren't all started at once. A zone we want a supervisor for
+ * starts out ZS_QUEUED, and the main loop forks them in the order they were
+ * queued, no more than start_max at a time (counting the ones that haven't
+ * sent us CMD_STARTED yet) and at least start_interval_ms apart. Otherwise,
+ * on a node with a lot of zones, boot turns into a storm of vmadm runs and
+ * card enumerations all fighting over the CPU and the one token.
+ *
+ * In lazy mode (TOKEN_LAZY) we don't start a zone's supervisor at all until
+ * something connects to it. We make and bind the zone's socket ourselves,
+ * and the zone sits in ZS_IDLE until that becomes readable. Then it's queued
+ * like any other, and the socket is handed down to the supervisor, so the
+ * connection that woke us up just waits in the backlog until the agent is
+ * ready to accept it. We keep our copy of the socket, so that if the
+ * supervisor dies, the zone can go back to ZS_IDLE without rebinding it.
+ */
+enum zone_phase {
+	ZS_IDLE = 1,	/* lazy: waiting for a connection on zs_listen */
+	ZS_QUEUED,	/* waiting for a start slot */
+	ZS_STARTING,	/* forked, waiting for CMD_STARTED */
+	ZS_RUNNING
+};
 
 struct zone_state {
 	zoneid_t zs_id;
 	struct zone_state *zs_next;
 	pid_t zs_child;
-	int zs_pipe[2];
+	int zs_pipe[2];		/* -1 while there's no child */
+	int zs_listen;		/* -1 unless we're lazy */
+	enum zone_phase zs_phase;
+	uint64_t zs_qseq;	/* start order, while ZS_QUEUED */
+	uint64_t zs_queued_ms;	/* when it was queued */
+	uint64_t zs_start_ms;	/* when we forked the child */
 	uint8_t zs_cookie;
 	boolean_t zs_unwanted;
-	boolean_t zs_need_restart;
 };
 static struct zone_state *zonest = NULL;
 static mutex_t zonest_mutex;
+static uint64_t zonest_qseq = 0;
 
 static evchan_t *evchan;
 
+/*
+ * The main thread sleeps on this: it gets the CMD_STARTED from each new
+ * supervisor, first connections to lazy zones' sockets, and a port_send()
+ * from the sysevent thread when a zone is queued.
+ */
+static int mgr_port = -1;
+
+static boolean_t start_lazy = B_FALSE;
+static uint start_max;
+static uint start_interval_ms;
+static uint64_t last_start_ms = 0;
+
+/* Set by the SIGCHLD handler; the main loop does the actual reaping. */
+static volatile sig_atomic_t reap_pending = 0;
+
+#define	DEFAULT_START_CONCURRENCY	4
+#define	DEFAULT_START_INTERVAL_MS	100
+
+/*
+ * A supervisor that hasn't sent CMD_STARTED within this long stops counting
+ * against start_max. It's probably stuck waiting on the card, and we'd rather
+ * it didn't hold up every other zone as well.
+ */
+#define	START_TIMEOUT_MS	(120 * 1000)
+
+/* Longest the main loop sleeps without looking around. */
+#define	MGR_TICK_MS		1000
+
+/* Default length of the log record queue, if LOG_ASYNC doesn't give one. */
+#define	LOG_ASYNC_QLEN	1024
+
+static uint64_t
+now_ms(void)
+{
+	return ((uint64_t)(gethrtime() / 1000000));
+}
+
+/*
+ * Rather than have every supervisor run "vmadm get" for its own zone (a
+ * node process per zone, and at boot all of them at once), we run one
+ * "vmadm lookup" for all of them and keep the results here, keyed by UUID
+ * (which is also the zone name). start_zone() hands each supervisor its own
+ * entry: it inherits it over the fork, so there's nothing to serialise.
+ *
+ * We only ask vmadm for the fields the supervisor and agent actually use,
+ * so that a supervisor isn't left with every other zone's metadata in its
+ * heap (it frees the cache, but that doesn't scrub it).
+ *
+ * The cache is refreshed when a zone we're about to start isn't in it (and
+ * wasn't queued before our last lookup), or when it's more than
+ * ZINFO_MAX_AGE_MS old. If a zone still isn't there, or vmadm lookup fails,
+ * the supervisor falls back to running "vmadm get" itself.
+ *
+ * The cache is only ever touched from the main thread, so start_pending()
+ * can drop zonest_mutex while vmadm runs (which takes a second or so) and
+ * not hold up the sysevent thread meanwhile.
+ */
+#define	ZINFO_FIELDS		"v,uuid,alias,owner_uuid,datacenter_name,tags"
+#define	ZINFO_MAX_LEN		(16*1024*1024)
+#define	ZINFO_MAX_AGE_MS	(5 * 60 * 1000)
+
+static nvlist_t *zinfo_cache = NULL;
+static uint64_t zinfo_refresh_ms = 0;
+
+static void
+zinfo_refresh(void)
+{
+	int vmpipe[2];
+	pid_t kid, w;
+	int stat = 0;
+	char *buf = NULL, *nbuf;
+	size_t len = 0, sz = 0;
+	ssize_t rv = 0;
+	nvlist_t *nvl = NULL, *cache, *ent;
+	nvlist_parse_json_error_t jsonerr;
+	uint32_t n, i;
+	char idx[16];
+	char *uuid;
+	int32_t v;
+	uint64_t start;
+
+	/*
+	 * Zones queued while vmadm is running might not be in its output, so
+	 * the cache only counts as covering those queued before we started.
+	 */
+	start = now_ms();
+
+	if (pipe(vmpipe) != 0) {
+		bunyan_log(WARN, "failed to make pipe for vmadm lookup",
+		    "errno", BNY_INT, errno, NULL);
+		goto out;
+	}
+
+	kid = forkx(FORK_WAITPID | FORK_NOSIGCHLD);
+	VERIFY(kid != -1);
+	if (kid == 0) {
+		VERIFY0(close(vmpipe[0]));
+		VERIFY3S(dup2(vmpipe[1], 1), ==, 1);
+		closefrom(3);
+		(void) execl("/usr/sbin/vmadm", "vmadm", "lookup", "-j",
+		    "-o", ZINFO_FIELDS, (char *)0);
+		_exit(1);
+	}
+	VERIFY0(close(vmpipe[1]));
+
+	for (;;) {
+		if (sz - len < 4096) {
+			if (sz >= ZINFO_MAX_LEN)
+				break;
+			sz = (sz == 0) ? 64*1024 : sz * 2;
+			nbuf = realloc(buf, sz);
+			VERIFY(nbuf != NULL);
+			buf = nbuf;
+		}
+		rv = read(vmpipe[0], buf + len, sz - len - 1);
+		if (rv == -1 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			break;
+		len += rv;
+	}
+	VERIFY0(close(vmpipe[0]));
+
+	do {
+		w = waitpid(kid, &stat, 0);
+	} while (w == -1 && errno == EINTR);
+
+	if (rv != 0 || !WIFEXITED(stat) || WEXITSTATUS(stat) != 0) {
+		bunyan_log(WARN, "vmadm lookup failed",
+		    "wait_status", BNY_INT, stat,
+		    "len", BNY_SIZE_T, len, NULL);
+		goto out;
+	}
+	buf[len] = '\0';
+
+	if (nvlist_parse_json(buf, len, &nvl, NVJSON_FORCE_INTEGER,
+	    &jsonerr) != 0) {
+		bunyan_log(WARN, "vmadm lookup json parse failure",
+		    "errno", BNY_INT, jsonerr.nje_errno,
+		    "pos", BNY_INT, jsonerr.nje_pos,
+		    "err", BNY_STRING, jsonerr.nje_message,
+		    NULL);
+		goto out;
+	}
+	/* A JSON array comes back with keys "0", "1", ... and "length". */
+	if (nvlist_lookup_uint32(nvl, "length", &n) != 0) {
+		bunyan_log(WARN, "vmadm lookup didn't return an array", NULL);
+		goto out;
+	}
+
+	VERIFY0(nvlist_alloc(&cache, NV_UNIQUE_NAME, 0));
+	for (i = 0; i < n; ++i) {
+		snprintf(idx, sizeof (idx), "%u", i);
+		if (nvlist_lookup_nvlist(nvl, idx, &ent) != 0 ||
+		    nvlist_lookup_int32(ent, "v", &v) != 0 || v != 1 ||
+		    nvlist_lookup_string(ent, "uuid", &uuid) != 0)
+			continue;
+		VERIFY0(nvlist_add_nvlist(cache, uuid, ent));
+	}
+	nvlist_free(zinfo_cache);
+	zinfo_cache = cache;
+
+	bunyan_log(DEBUG, "fetched zone info from vmadm lookup",
+	    "count", BNY_INT, (int)n,
+	    "len", BNY_SIZE_T, len, NULL);
+
+out:
+	nvlist_free(nvl);
+	free(buf);
+	zinfo_refresh_ms = start;
+}
+
+/*
+ * Looks up the cached vmadm info for a zone we're about to start. Returns
+ * B_FALSE if the cache has to be refreshed first, which the caller must do
+ * with zinfo_refresh() after dropping zonest_mutex. Otherwise, *zinfop is
+ * the zone's entry (which belongs to the cache), or NULL if the supervisor
+ * will have to go and get it itself.
+ */
+static boolean_t
+zinfo_get(struct zone_state *zs, nvlist_t **zinfop)
+{
+	char zonename[ZONENAME_MAX];
+	nvlist_t *zinfo = NULL;
+	boolean_t found;
+
+	*zinfop = NULL;
+
+	/* The global zone doesn't have any. */
+	if (zs->zs_id == GLOBAL_ZONEID)
+		return (B_TRUE);
+	if (getzonenamebyid(zs->zs_id, zonename, sizeof (zonename)) <= 0)
+		return (B_TRUE);
+
+	found = (zinfo_cache != NULL &&
+	    nvlist_lookup_nvlist(zinfo_cache, zonename, &zinfo) == 0);
+	if ((!found && zinfo_refresh_ms < zs->zs_queued_ms) ||
+	    (found && now_ms() - zinfo_refresh_ms > ZINFO_MAX_AGE_MS))
+		return (B_FALSE);
+	if (!found) {
+		bunyan_log(DEBUG, "zone not found by vmadm lookup",
+		    "zoneid", BNY_INT, (int)zs->zs_id,
+		    "zonename", BNY_STRING, zonename, NULL);
+		return (B_TRUE);
+	}
+	*zinfop = zinfo;
+	return (B_TRUE);
+}
+
 static int
 fdwalk_assert_fd(void *p, int fd)
 {
 	struct zone_state *zs = (struct zone_state *)p;
-	if (fd != zs->zs_pipe[1])
+	if (fd != zs->zs_pipe[1] && fd != zs->zs_listen)
 		VERIFY3S(fd, <=, 2);
 	return (0);
 }
 
 static void
-start_supervisor(struct zone_state *forzone)
+start_supervisor(struct zone_state *forzone, nvlist_t *zinfo)
 {
 	struct zone_state *zs;
 	struct sigaction sa;
+	nvlist_t *myzinfo = NULL;
 
 	VERIFY0(sysevent_evc_unbind(evchan));
 
@@ -69,39 +317,155 @@ start_supervisor(struct zone_state *forzone)
 	VERIFY0(sigaction(SIGCHLD, &sa, NULL));
 
 	for (zs = zonest; zs != NULL; zs = zs->zs_next) {
-		if (!zs->zs_need_restart)
+		if (zs->zs_pipe[0] != -1)
 			VERIFY0(close(zs->zs_pipe[0]));
+		if (zs != forzone && zs->zs_listen != -1)
+			VERIFY0(close(zs->zs_listen));
 	}
+	/* Ports aren't inherited across fork(), but the fd might be. */
+	(void) close(mgr_port);
 	VERIFY0(fdwalk(fdwalk_assert_fd, forzone));
 
-	supervisor_main(forzone->zs_id, forzone->zs_pipe[1]);
+	/* Keep our own zone's info, and none of the others'. */
+	if (zinfo != NULL)
+		VERIFY0(nvlist_dup(zinfo, &myzinfo, 0));
+	nvlist_free(zinfo_cache);
+	zinfo_cache = NULL;
+
+	supervisor_main(forzone->zs_id, forzone->zs_pipe[1],
+	    forzone->zs_listen, myzinfo);
 	bunyan_log(ERROR, "supervisor_main returned!", NULL);
 	exit(1);
 }
 
+/*
+ * Makes and binds the socket for a zone that we're starting lazily. Returns
+ * -1 if we couldn't, in which case the zone just gets started straight away
+ * and the supervisor has a go at it.
+ */
+static int
+make_listen_sock(zoneid_t id)
+{
+	char zonename[ZONENAME_MAX];
+	char sockdir[PATH_MAX];
+	struct sockaddr_un addr;
+	int fd;
+
+	if (getzonenamebyid(id, zonename, sizeof (zonename)) <= 0)
+		return (-1);
+
+	snprintf(sockdir, sizeof (sockdir), TOKEN_SOCKET_DIR, zonename);
+	(void) mkdir(sockdir, 0700);
+
+	bzero(&addr, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof (addr.sun_path) - 1,
+	    TOKEN_SOCKET_PATH, zonename);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return (-1);
+	(void) unlink(addr.sun_path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof (addr)) != 0 ||
+	    listen(fd, env_uint("TOKEN_LISTEN_BACKLOG",
+	    DEFAULT_LISTEN_BACKLOG)) != 0) {
+		bunyan_log(WARN, "failed to make zone socket, starting "
+		    "supervisor now",
+		    "zoneid", BNY_INT, (int)id,
+		    "sockpath", BNY_STRING, addr.sun_path,
+		    "errno", BNY_INT, errno, NULL);
+		VERIFY0(close(fd));
+		return (-1);
+	}
+
+	bunyan_log(DEBUG, "waiting for first connection to zone socket",
+	    "zoneid", BNY_INT, (int)id,
+	    "sockpath", BNY_STRING, addr.sun_path, NULL);
+	return (fd);
+}
+
+/* Puts a zone at the back of the start queue (or back to ZS_IDLE). */
 static void
-add_zone_unlocked(zoneid_t id)
+queue_zone(struct zone_state *zs, boolean_t lazy)
 {
-	struct zone_state *zs = calloc(1, sizeof (struct zone_state));
-	VERIFY3P(zs, !=, NULL);
-	zs->zs_id = id;
-	zs->zs_unwanted = B_FALSE;
+	if (lazy && zs->zs_listen != -1) {
+		zs->zs_phase = ZS_IDLE;
+		VERIFY0(port_associate(mgr_port, PORT_SOURCE_FD,
+		    zs->zs_listen, POLLIN, NULL));
+		return;
+	}
+	zs->zs_phase = ZS_QUEUED;
+	zs->zs_qseq = ++zonest_qseq;
+	zs->zs_queued_ms = now_ms();
+	/* Wake up the main loop, in case this is the sysevent thread. */
+	(void) port_send(mgr_port, 0, NULL);
+}
+
+static void
+start_zone(struct zone_state *zs, nvlist_t *zinfo)
+{
+	pid_t kid;
+
+	VERIFY3S(zs->zs_phase, ==, ZS_QUEUED);
 	VERIFY0(pipe(zs->zs_pipe));
 
-	pid_t kid = fork();
+	kid = fork();
 	VERIFY3S(kid, !=, -1);
 	if (kid == 0) {
-		VERIFY0(close(zs->zs_pipe[0]));
-		start_supervisor(zs);
+		start_supervisor(zs, zinfo);
 		return;
 	}
 	zs->zs_child = kid;
 	VERIFY0(close(zs->zs_pipe[1]));
+	zs->zs_pipe[1] = -1;
+
+	zs->zs_phase = ZS_STARTING;
+	zs->zs_start_ms = last_start_ms = now_ms();
+	VERIFY0(port_associate(mgr_port, PORT_SOURCE_FD, zs->zs_pipe[0],
+	    POLLIN, NULL));
+
+	bunyan_log(DEBUG, "starting zone supervisor",
+	    "zoneid", BNY_INT, (int)zs->zs_id,
+	    "pid", BNY_INT, (int)kid, NULL);
+}
+
+static void
+add_zone_unlocked(zoneid_t id)
+{
+	struct zone_state *zs = calloc(1, sizeof (struct zone_state));
+	VERIFY3P(zs, !=, NULL);
+	zs->zs_id = id;
+	zs->zs_unwanted = B_FALSE;
+	zs->zs_pipe[0] = zs->zs_pipe[1] = -1;
+	zs->zs_listen = -1;
+	if (start_lazy)
+		zs->zs_listen = make_listen_sock(id);
+	queue_zone(zs, B_TRUE);
 
 	zs->zs_next = zonest;
 	zonest = zs;
 }
 
+static void
+remove_zone_unlocked(struct zone_state *zs)
+{
+	struct zone_state *zsp = NULL, *z;
+
+	for (z = zonest; z != NULL; zsp = z, z = z->zs_next) {
+		if (z == zs)
+			break;
+	}
+	VERIFY3P(z, ==, zs);
+	if (zsp != NULL)
+		zsp->zs_next = zs->zs_next;
+	else
+		zonest = zs->zs_next;
+
+	if (zs->zs_listen != -1)
+		VERIFY0(close(zs->zs_listen));
+	free(zs);
+}
+
 static void
 check_add_zone(zoneid_t id)
 {
@@ -141,6 +505,7 @@ read_cmd(int fd, struct ctl_cmd *cmd)
 		return (errno);
 	if (rv == 0)
 		return (ENOENT);
+	fr_record(FR_CMD_RECV, cmd->cc_type, cmd->cc_cookie, cmd->cc_p1, 0);
 	bunyan_log(TRACE, "received cmd",
 	    "cookie", BNY_INT, cmd->cc_cookie,
 	    "type", BNY_INT, cmd->cc_type,
@@ -154,6 +519,7 @@ write_cmd(int fd, const struct ctl_cmd *cmd)
 {
 	size_t off = 0, rem = sizeof (*cmd);
 	int rv;
+	fr_record(FR_CMD_SEND, cmd->cc_type, cmd->cc_cookie, cmd->cc_p1, 0);
 	bunyan_log(TRACE, "sending cmd",
 	    "cookie", BNY_INT, cmd->cc_cookie,
 	    "type", BNY_INT, cmd->cc_type,
@@ -172,6 +538,82 @@ write_cmd(int fd, const struct ctl_cmd *cmd)
 	return (0);
 }
 
+/*
+ * Reads a numeric setting from the environment, falling back to a
+ * default if it's unset or not a sane number.
+ */
+uint
+env_uint(const char *name, uint def)
+{
+	const char *val;
+	char *p;
+	unsigned long v;
+
+	val = getenv(name);
+	if (val == NULL || *val == '\0')
+		return (def);
+	errno = 0;
+	v = strtoul(val, &p, 10);
+	if (errno != 0 || *p != '\0' || v == 0 || v > UINT_MAX) {
+		bunyan_log(WARN, "ignoring invalid setting in environment",
+		    "name", BNY_STRING, name,
+		    "value", BNY_STRING, val, NULL);
+		return (def);
+	}
+	return ((uint)v);
+}
+
+int
+ring_doorbell(int fd)
+{
+	struct ctl_cmd cmd;
+
+	bzero(&cmd, sizeof (cmd));
+	cmd.cc_type = CMD_RING;
+	return (write_cmd(fd, &cmd));
+}
+
+/*
+ * Adds an entry to a ctl_ring. Each ring has exactly one producer, so this
+ * needs no locking beyond making sure the entry is visible before the new
+ * head is. Returns ENOSPC if the ring is full.
+ */
+int
+ctl_ring_put(struct ctl_ring *r, const struct ctl_req *req)
+{
+	uint32_t head = r->cr_head;
+
+	membar_consumer();
+	if (head - r->cr_tail >= CTL_RING_SIZE)
+		return (ENOSPC);
+	r->cr_ents[head & (CTL_RING_SIZE - 1)] = *req;
+	membar_producer();
+	r->cr_head = head + 1;
+	fr_record(FR_REQ_PUT, req->cr_type, req->cr_id, req->cr_slot,
+	    req->cr_status);
+	return (0);
+}
+
+/*
+ * Takes the oldest entry off a ctl_ring (again, there is only one consumer).
+ * Returns ENOENT if the ring is empty.
+ */
+int
+ctl_ring_get(struct ctl_ring *r, struct ctl_req *req)
+{
+	uint32_t tail = r->cr_tail;
+
+	if (tail == r->cr_head)
+		return (ENOENT);
+	membar_consumer();
+	*req = r->cr_ents[tail & (CTL_RING_SIZE - 1)];
+	membar_exit();
+	r->cr_tail = tail + 1;
+	fr_record(FR_REQ_GET, req->cr_type, req->cr_id, req->cr_slot,
+	    req->cr_status);
+	return (0);
+}
+
 static void
 stop_zone(zoneid_t id)
 {
@@ -185,7 +627,13 @@ stop_zone(zoneid_t id)
 		}
 	}
 
-	if (zs != NULL) {
+	if (zs != NULL && zs->zs_child == 0) {
+		/* Not started (or between restarts): just forget about it. */
+		bunyan_log(DEBUG, "removing unstarted zone from index",
+		    "zoneid", BNY_INT, (int)id, NULL);
+		remove_zone_unlocked(zs);
+
+	} else if (zs != NULL) {
 		zs->zs_unwanted = B_TRUE;
 
 		bunyan_log(DEBUG, "sending shutdown command to zone",
@@ -238,17 +686,30 @@ sysevc_handler(sysevent_t *ev, void *cookie)
 	return (0);
 }
 
+/*
+ * This only notes that there's something to reap: the main loop does the rest
+ * under zonest_mutex, which we can't take here (the signal could land on a
+ * thread that's already holding it). If it lands on one of the sysevent
+ * threads rather than the main one, the main loop picks it up within
+ * MGR_TICK_MS.
+ */
+static void
+sigchld_handler(int signo)
+{
+	reap_pending = 1;
+}
+
 static void
-sigchld_handler(int signo, siginfo_t *info, void *ctx)
+reap_children(void)
 {
 	pid_t kid;
 	int kid_status;
-	struct zone_state *zsp = NULL, *zs;
+	struct zone_state *zs;
 	zoneid_t zid;
 
 	while ((kid = waitpid((pid_t)0, &kid_status, WNOHANG)) > 0) {
 		mutex_enter(&zonest_mutex);
-		for (zs = zonest; zs != NULL; zsp = zs, zs = zs->zs_next) {
+		for (zs = zonest; zs != NULL; zs = zs->zs_next) {
 			if (zs->zs_child == kid) {
 				break;
 			}
@@ -265,24 +726,126 @@ sigchld_handler(int signo, siginfo_t *info, void *ctx)
 			    NULL);
 
 			VERIFY0(close(zs->zs_pipe[0]));
+			zs->zs_pipe[0] = -1;
 			zs->zs_child = 0;
 
 			if (zs->zs_unwanted) {
-				if (zsp != NULL) {
-					zsp->zs_next = zs->zs_next;
-				} else {
-					VERIFY3P(zonest, ==, zs);
-					zonest = zs->zs_next;
-				}
-				free(zs);
+				remove_zone_unlocked(zs);
 			} else {
-				zs->zs_need_restart = B_TRUE;
+				bunyan_log(WARN,
+				    "restarting zone supervisor",
+				    "zoneid", BNY_INT, (int)zid,
+				    "lazy", BNY_INT, (zs->zs_listen != -1),
+				    NULL);
+				queue_zone(zs, B_TRUE);
 			}
 		}
 		mutex_exit(&zonest_mutex);
 	}
 }
 
+/*
+ * Forks as many queued supervisors as start_max and start_interval_ms let us,
+ * and returns how long the main loop can sleep before it should try again.
+ */
+static uint64_t
+start_pending(void)
+{
+	struct zone_state *zs, *next;
+	nvlist_t *zinfo;
+	uint64_t now, wait;
+	uint nstarting;
+
+	mutex_enter(&zonest_mutex);
+	for (;;) {
+		now = now_ms();
+		nstarting = 0;
+		next = NULL;
+		for (zs = zonest; zs != NULL; zs = zs->zs_next) {
+			if (zs->zs_phase == ZS_STARTING &&
+			    now - zs->zs_start_ms >= START_TIMEOUT_MS) {
+				bunyan_log(WARN, "zone supervisor is slow to "
+				    "start, not waiting for it",
+				    "zoneid", BNY_INT, (int)zs->zs_id,
+				    "pid", BNY_INT, (int)zs->zs_child, NULL);
+				zs->zs_phase = ZS_RUNNING;
+			}
+			if (zs->zs_phase == ZS_STARTING)
+				++nstarting;
+			if (zs->zs_phase == ZS_QUEUED && (next == NULL ||
+			    zs->zs_qseq < next->zs_qseq))
+				next = zs;
+		}
+		if (next == NULL || nstarting >= start_max) {
+			wait = MGR_TICK_MS;
+			break;
+		}
+		if (now - last_start_ms < start_interval_ms) {
+			wait = start_interval_ms - (now - last_start_ms);
+			break;
+		}
+		if (!zinfo_get(next, &zinfo)) {
+			/*
+			 * next might not be there any more once we have the
+			 * lock back, so go round and pick again.
+			 */
+			mutex_exit(&zonest_mutex);
+			zinfo_refresh();
+			mutex_enter(&zonest_mutex);
+			continue;
+		}
+		start_zone(next, zinfo);
+	}
+	mutex_exit(&zonest_mutex);
+
+	return (wait);
+}
+
+static void
+handle_event(const port_event_t *ev)
+{
+	struct zone_state *zs;
+	struct ctl_cmd cmd;
+	int fd;
+
+	/* Anything else is just a port_send() to wake us up. */
+	if (ev->portev_source != PORT_SOURCE_FD)
+		return;
+	fd = (int)ev->portev_object;
+
+	mutex_enter(&zonest_mutex);
+	for (zs = zonest; zs != NULL; zs = zs->zs_next) {
+		if (zs->zs_pipe[0] == fd || zs->zs_listen == fd)
+			break;
+	}
+	if (zs == NULL) {
+		mutex_exit(&zonest_mutex);
+		return;
+	}
+
+	if (fd == zs->zs_listen && zs->zs_phase == ZS_IDLE) {
+		bunyan_log(INFO, "first connection to zone socket, "
+		    "starting supervisor",
+		    "zoneid", BNY_INT, (int)zs->zs_id, NULL);
+		queue_zone(zs, B_FALSE);
+
+	} else if (fd == zs->zs_pipe[0]) {
+		/*
+		 * If this isn't CMD_STARTED, it's EOF because the child has
+		 * died, and reap_children() will deal with that.
+		 */
+		if (read_cmd(fd, &cmd) == 0 && cmd.cc_type == CMD_STARTED) {
+			bunyan_log(INFO, "zone supervisor started",
+			    "zoneid", BNY_INT, (int)zs->zs_id,
+			    "pid", BNY_INT, (int)zs->zs_child,
+			    "startup_ms", BNY_UINT64,
+			    now_ms() - zs->zs_start_ms, NULL);
+			zs->zs_phase = ZS_RUNNING;
+		}
+	}
+	mutex_exit(&zonest_mutex);
+}
+
 const char *
 _umem_debug_init()
 {
@@ -296,11 +859,14 @@ main(int argc, char *argv[])
 	char subid[128];
 	const char *lvl;
 	struct sigaction sa;
-	struct zone_state *zsp = NULL, *zs;
-	zoneid_t zid;
+	port_event_t ev;
+	timespec_t to;
+	uint64_t wait;
+	int rv;
 
 	bunyan_init();
 	bunyan_set_name("softtoken_mgr");
+	fr_init("softtoken_mgr");
 	bunyan_log(INFO, "starting up", NULL);
 
 	bunyan_set_level(DEBUG);
@@ -317,12 +883,79 @@ main(int argc, char *argv[])
 			bunyan_set_level(ERROR);
 	}
 
+	/*
+	 * LOG_SAMPLE=N keeps only one in every N TRACE, DEBUG and INFO records
+	 * from each place we log from, and LOG_RATE=N at most N of them per
+	 * second from each place. What's left out is summed up in a "log
+	 * messages suppressed" record every so often.
+	 */
+	bunyan_set_limits(env_uint("LOG_SAMPLE", 1), env_uint("LOG_RATE", 0));
+
+	/*
+	 * LOG_COARSE_CLOCK trades timestamp precision (to within 10ms) for not
+	 * reading the clock on every log record.
+	 */
+	lvl = getenv("LOG_COARSE_CLOCK");
+	if (lvl != NULL && (strcasecmp(lvl, "yes") == 0 ||
+	    strcasecmp(lvl, "true") == 0 || strcmp(lvl, "1") == 0)) {
+		bunyan_set_coarse_clock(B_TRUE);
+	}
+
+	/*
+	 * LOG_ASYNC makes logging asynchronous: it can be "yes" or the length
+	 * of the queue of log records. LOG_ASYNC_OVERFLOW chooses what we do
+	 * when the queue fills up: "drop-lowest" (the default), "drop-new" or
+	 * "block".
+	 */
+	lvl = getenv("LOG_ASYNC");
+	if (lvl != NULL && strcasecmp(lvl, "no") != 0 &&
+	    strcasecmp(lvl, "false") != 0 && strcmp(lvl, "0") != 0) {
+		uint_t qlen = strtoul(lvl, NULL, 10);
+		enum bunyan_overflow policy = BNY_OVERFLOW_DROP_LOWEST;
+		const char *ovf = getenv("LOG_ASYNC_OVERFLOW");
+
+		if (qlen == 0)
+			qlen = LOG_ASYNC_QLEN;
+		if (ovf != NULL && strcasecmp(ovf, "drop-new") == 0)
+			policy = BNY_OVERFLOW_DROP_NEW;
+		if (ovf != NULL && strcasecmp(ovf, "block") == 0)
+			policy = BNY_OVERFLOW_BLOCK;
+		bunyan_set_async(qlen, policy);
+	}
+
+	/*
+	 * Each process keeps histograms of how long unlocks, signatures etc
+	 * take, and logs them every LOG_HIST_INTERVAL seconds (0 to only do
+	 * it on SIGUSR1). This sets up the SIGUSR1 handler, which the
+	 * supervisors and agents inherit.
+	 */
+	bunyan_hist_init(env_uint("LOG_HIST_INTERVAL", 300));
+
+	/*
+	 * We start at most TOKEN_START_CONCURRENCY zone supervisors at once,
+	 * and at least TOKEN_START_INTERVAL_MS apart. With TOKEN_LAZY, we
+	 * don't start a zone's supervisor until something connects to its
+	 * socket.
+	 */
+	start_max = env_uint("TOKEN_START_CONCURRENCY",
+	    DEFAULT_START_CONCURRENCY);
+	start_interval_ms = env_uint("TOKEN_START_INTERVAL_MS",
+	    DEFAULT_START_INTERVAL_MS);
+	lvl = getenv("TOKEN_LAZY");
+	if (lvl != NULL && (strcasecmp(lvl, "yes") == 0 ||
+	    strcasecmp(lvl, "true") == 0 || strcmp(lvl, "1") == 0)) {
+		start_lazy = B_TRUE;
+	}
+
 	VERIFY0(mutex_init(&zonest_mutex,
 	    USYNC_THREAD | LOCK_ERRORCHECK, NULL));
 
+	mgr_port = port_create();
+	VERIFY3S(mgr_port, >=, 0);
+
 	bzero(&sa, sizeof (sa));
-	sa.sa_sigaction = sigchld_handler;
-	sa.sa_flags = SA_NOCLDSTOP | SA_SIGINFO;
+	sa.sa_handler = sigchld_handler;
+	sa.sa_flags = SA_NOCLDSTOP;
 	VERIFY0(sigaction(SIGCHLD, &sa, NULL));
 
 	VERIFY0(sysevent_evc_bind(channel, &evchan, 0));
@@ -333,27 +966,20 @@ main(int argc, char *argv[])
 	add_all_zones();
 
 	for (;;) {
-		pause();
+		if (reap_pending) {
+			reap_pending = 0;
+			reap_children();
+		}
+		bunyan_hist_tick();
 
-		mutex_enter(&zonest_mutex);
-		for (zs = zonest; zs != NULL; zsp = zs, zs = zs->zs_next) {
-			if (zs->zs_need_restart) {
-				zid = zs->zs_id;
-				if (zsp != NULL) {
-					zsp->zs_next = zs->zs_next;
-				} else {
-					VERIFY3P(zonest, ==, zs);
-					zonest = zs->zs_next;
-				}
-				free(zs);
+		wait = start_pending();
+		to.tv_sec = wait / 1000;
+		to.tv_nsec = (wait % 1000) * 1000000;
 
-				bunyan_log(WARN,
-				    "restarting zone supervisor",
-				    "zoneid", BNY_INT, (int)zid,
-				    NULL);
-				add_zone_unlocked(zid);
-			}
-		}
-		mutex_exit(&zonest_mutex);
+		rv = port_get(mgr_port, &ev, &to);
+		if (rv == -1 && (errno == EINTR || errno == ETIME))
+			continue;
+		VERIFY0(rv);
+		handle_event(&ev);
 	}
 }
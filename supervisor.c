@@ -21,6 +21,7 @@
 #include <string.h>
 #include <strings.h>
 #include <signal.h>
+#include <atomic.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -32,6 +33,7 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <port.h>
+#include <poll.h>
 #include <dlfcn.h>
 #include <link.h>
 
@@ -44,6 +46,8 @@
 #include <openssl/err.h>
 
 #include "softtoken.h"
+#include "softtoken_provider.h"
+#include "flightrec.h"
 #include "bunyan.h"
 #include "piv.h"
 #include "json.h"
@@ -75,10 +79,16 @@
 
 struct token_slot *token_slots = NULL;
 size_t slot_n = 0;
+volatile uint32_t *token_cert_gen = NULL;
+struct ctl_rings *token_ctl_rings = NULL;
 
 static pid_t agent_pid;
 static uint8_t id_seed;
 
+/* The agent's stderr, once supervisor_loop() is watching it. */
+static int sup_logfd = -1;
+static char *sup_logbuf;
+
 extern mutex_t *bunyan_wrmutex;
 
 static SCARDCONTEXT sup_ctx;
@@ -1012,76 +1022,74 @@ lock_key(struct token_slot *slot)
 }
 
 /*
- * Unlocks a key by decrypting it and writing it into the shared memory segment
- * so our child process (running agent_main()) can use it.
+ * State for one key unlock that's in progress. We can service several of these
+ * inside a single card transaction (see unlock_keys()).
  */
-static int
-unlock_key(struct token_slot *slot)
+struct unlock_req {
+	struct token_slot *ur_slot;
+	uint32_t ur_id;
+	struct piv_ecdh_box *ur_box;
+	struct piv_token *ur_tk;
+	struct piv_slot *ur_sl;
+	struct bunyan_timers *ur_tms;
+	boolean_t ur_done;
+};
+
+#define	MAX_CMD_BATCH	16
+
+/*
+ * First stage of unlocking a key: parse the box out of the key file and find
+ * the token that can open it. This doesn't touch the card.
+ */
+static void
+unlock_key_prepare(struct unlock_req *req)
 {
-	struct piv_token *tk, *tks, *systk = NULL;
-	struct piv_slot *sl;
-	struct piv_ecdh_box *box;
-	nvlist_t *nv = slot->ts_nvl;
-	int rv;
+	struct piv_token *tks;
+	nvlist_t *nv = req->ur_slot->ts_nvl;
+	uchar_t *boxd;
+	uint_t boxdlen;
 
-	uchar_t *boxd, *key, *iv, *encdata;
-	uint_t boxdlen, ivlen, authlen, blocksz, enclen;
-	size_t keylen;
-	const struct sshcipher *cipher;
-	struct sshbuf *buf;
-	struct sshkey *pkey;
-	struct sshcipher_ctx *cctx;
-	char *ciphername;
-	struct bunyan_timers *tms;
-	uint attempts;
-	const char *pin;
+	SOFTTOKEN_KEY_UNLOCK_START((char *)req->ur_slot->ts_name);
 
-	tms = bny_timers_new();
-	VERIFY3P(tms, !=, NULL);
-	VERIFY0(bny_timer_begin(tms));
+	req->ur_tms = bny_timers_new();
+	VERIFY3P(req->ur_tms, !=, NULL);
+	VERIFY0(bny_timer_begin(req->ur_tms));
 
 	tks = sup_systk;
 
 	VERIFY0(nvlist_lookup_byte_array(nv, "local-box", &boxd, &boxdlen));
-	VERIFY0(piv_box_from_binary(boxd, boxdlen, &box));
+	VERIFY0(piv_box_from_binary(boxd, boxdlen, &req->ur_box));
 
-	VERIFY0(piv_box_find_token(tks, box, &tk, &sl));
+	VERIFY0(piv_box_find_token(tks, req->ur_box, &req->ur_tk,
+	    &req->ur_sl));
 
-	rv = piv_system_token_find(tks, &systk);
-	if (rv != 0) {
-		bunyan_log(WARN, "failed to get a system PIV token", NULL);
-	}
-	if (tk != systk && systk != NULL) {
-		bunyan_log(WARN, "attempting to decrypt key using a PIV "
-		    "token that is not the system token",
-		    "box_guid", BNY_BIN_HEX,
-		    tk->pt_guid, sizeof (tk->pt_guid),
-		    "system_guid", BNY_BIN_HEX,
-		    systk->pt_guid, sizeof (systk->pt_guid),
-		    NULL);
-	}
-
-	VERIFY0(bny_timer_next(tms, "select_yubikey"));
+	VERIFY0(bny_timer_next(req->ur_tms, "select_yubikey"));
+}
 
-	attempts = 1;
+/*
+ * Last stage of unlocking a key: once the box has been opened on the card,
+ * use the key inside it to decrypt the key data into the shared memory
+ * segment, and check that it matches the public key we expect.
+ */
+static void
+unlock_key_finish(struct unlock_req *req)
+{
+	struct token_slot *slot = req->ur_slot;
+	nvlist_t *nv = slot->ts_nvl;
+	uchar_t *key, *iv, *encdata;
+	uint_t ivlen, authlen, blocksz, enclen;
+	size_t keylen;
+	const struct sshcipher *cipher;
+	struct sshbuf *buf;
+	struct sshkey *pkey;
+	struct sshcipher_ctx *cctx;
+	char *ciphername;
 
-	VERIFY0(piv_txn_begin(tk));
-	VERIFY0(piv_select(tk));
-	if (tk == systk) {
-		VERIFY0(piv_system_token_auth(tk));
-	} else {
-		pin = getenv("PIV_LOCAL_PIN");
-		if (pin == NULL)
-			pin = "123456";
-		VERIFY0(piv_verify_pin(tk, pin, &attempts));
-	}
-	VERIFY0(piv_box_open(tk, sl, box));
-	piv_txn_end(tk);
+	VERIFY0(piv_box_take_data(req->ur_box, &key, &keylen));
+	piv_box_free(req->ur_box);
+	req->ur_box = NULL;
 
-	VERIFY0(piv_box_take_data(box, &key, &keylen));
-	piv_box_free(box);
-
-	VERIFY0(bny_timer_next(tms, "ecdh_kd"));
+	VERIFY0(bny_timer_next(req->ur_tms, "ecdh_kd"));
 
 	VERIFY0(nvlist_lookup_string(nv, "encalgo", &ciphername));
 	VERIFY0(nvlist_lookup_byte_array(nv, "iv", &iv, &ivlen));
@@ -1106,7 +1114,7 @@ unlock_key(struct token_slot *slot)
 	explicit_bzero(key, keylen);
 	free(key);
 
-	VERIFY0(bny_timer_next(tms, "decrypt"));
+	VERIFY0(bny_timer_next(req->ur_tms, "decrypt"));
 
 	buf = sshbuf_from((const void *)slot->ts_data->tsd_data,
 	    slot->ts_data->tsd_len);
@@ -1116,14 +1124,132 @@ unlock_key(struct token_slot *slot)
 	sshkey_free(pkey);
 	sshbuf_free(buf);
 
-	VERIFY0(bny_timer_next(tms, "verify"));
+	VERIFY0(bny_timer_next(req->ur_tms, "verify"));
 
 	bunyan_log(DEBUG, "unlocked key",
 	    "keyname", BNY_STRING, slot->ts_name,
-	    "timers", BNY_TIMERS, tms, NULL);
-	bny_timers_free(tms);
+	    "timers", BNY_TIMERS, req->ur_tms, NULL);
+	bny_timers_record(req->ur_tms, "unlock");
+	bny_timers_free(req->ur_tms);
+	req->ur_tms = NULL;
+	req->ur_done = B_TRUE;
 
-	return (0);
+	SOFTTOKEN_KEY_UNLOCK_DONE((char *)slot->ts_name, 0);
+}
+
+/*
+ * Queues up the reply to one of the agent's requests on the completion ring.
+ * The caller is responsible for ringing the doorbell afterwards.
+ */
+static void
+post_reply(const struct ctl_req *req, enum ctl_cmd_status status)
+{
+	struct ctl_req rep;
+
+	rep = *req;
+	rep.cr_status = status;
+	/*
+	 * The agent has at most two requests outstanding per slot, so the
+	 * ring can't fill up unless it's misbehaving.
+	 */
+	VERIFY0(ctl_ring_put(&token_ctl_rings->cr_cq, &rep));
+}
+
+/*
+ * Unlocks a set of keys by decrypting them and writing them into the shared
+ * memory segments so our child process (running agent_main()) can use them.
+ *
+ * All the keys that are boxed to the same token are opened inside a single
+ * card transaction, so we only pay for the SELECT and the PIN/auth once. The
+ * agent gets its reply (and a doorbell) for each key as soon as that key is
+ * ready, rather than waiting for the whole batch.
+ */
+static void
+unlock_keys(struct unlock_req *reqs, size_t n, int kidfd)
+{
+	struct piv_token *tk, *systk = NULL;
+	struct ctl_req req;
+	size_t i, j;
+	uint attempts;
+	const char *pin;
+
+	for (i = 0; i < n; ++i)
+		unlock_key_prepare(&reqs[i]);
+
+	if (piv_system_token_find(sup_systk, &systk) != 0) {
+		bunyan_log(WARN, "failed to get a system PIV token", NULL);
+		systk = NULL;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (reqs[i].ur_done)
+			continue;
+		tk = reqs[i].ur_tk;
+
+		if (systk != NULL && tk != systk) {
+			bunyan_log(WARN, "attempting to decrypt keys using a "
+			    "PIV token that is not the system token",
+			    "box_guid", BNY_BIN_HEX,
+			    tk->pt_guid, sizeof (tk->pt_guid),
+			    "system_guid", BNY_BIN_HEX,
+			    systk->pt_guid, sizeof (systk->pt_guid),
+			    NULL);
+		}
+
+		attempts = 1;
+
+		VERIFY0(piv_txn_begin(tk));
+		VERIFY0(piv_select(tk));
+		if (tk == systk) {
+			VERIFY0(piv_system_token_auth(tk));
+		} else {
+			pin = getenv("PIV_LOCAL_PIN");
+			if (pin == NULL)
+				pin = "123456";
+			VERIFY0(piv_verify_pin(tk, pin, &attempts));
+		}
+
+		for (j = i; j < n; ++j) {
+			if (reqs[j].ur_done || reqs[j].ur_tk != tk)
+				continue;
+			VERIFY0(piv_box_open(tk, reqs[j].ur_sl,
+			    reqs[j].ur_box));
+			unlock_key_finish(&reqs[j]);
+
+			bzero(&req, sizeof (req));
+			req.cr_id = reqs[j].ur_id;
+			req.cr_type = CMD_UNLOCK_KEY;
+			req.cr_slot = reqs[j].ur_slot->ts_id;
+			post_reply(&req, STATUS_OK);
+			VERIFY0(ring_doorbell(kidfd));
+		}
+
+		piv_txn_end(tk);
+	}
+
+	if (n > 1) {
+		bunyan_log(DEBUG, "unlocked keys in batch",
+		    "count", BNY_SIZE_T, n, NULL);
+	}
+}
+
+/*
+ * Returns B_TRUE if there is another doorbell from the agent already waiting
+ * to be read on kidfd.
+ */
+static boolean_t
+kid_cmd_pending(int kidfd)
+{
+	struct pollfd pfd;
+	int rv;
+
+	bzero(&pfd, sizeof (pfd));
+	pfd.fd = kidfd;
+	pfd.events = POLLIN;
+	do {
+		rv = poll(&pfd, 1, 0);
+	} while (rv == -1 && errno == EINTR);
+	return (rv == 1 && (pfd.revents & POLLIN) != 0);
 }
 
 static void
@@ -1338,12 +1464,41 @@ again:
 	}
 }
 
+/*
+ * Reads whatever is waiting on the agent's stderr and passes it through to
+ * ours. Mostly this is just NUL bytes asking us to drain the log ring, which
+ * we drop, but anything else that got written to its stdout/stderr (like a
+ * flight recorder dump) goes through as-is. Returns what read() did, with its
+ * errno in *errp.
+ */
+static ssize_t
+pass_agent_stderr(int logfd, char *logbuf, int *errp)
+{
+	ssize_t n, j, k;
+
+	do {
+		n = read(logfd, logbuf, MAX_LOG_LINE);
+	} while (n == -1 && errno == EINTR);
+	*errp = errno;
+	for (j = 0, k = 0; j < n; ++j) {
+		if (logbuf[j] != '\0')
+			logbuf[k++] = logbuf[j];
+	}
+	if (k > 0) {
+		mutex_enter(bunyan_wrmutex);
+		(void) fwrite(logbuf, 1, k, stderr);
+		mutex_exit(bunyan_wrmutex);
+	}
+	return (n);
+}
+
 static void
 supervisor_panic(void)
 {
 	struct token_slot *ts;
+	struct pollfd pfd;
 	pid_t w;
-	int rv;
+	int rv = 0, err;
 
 	bunyan_log(ERROR, "panic!", NULL);
 
@@ -1351,18 +1506,79 @@ supervisor_panic(void)
 		(void) lock_key(ts);
 	}
 	(void) kill(agent_pid, SIGABRT);
+
+	/*
+	 * The agent writes out its flight recorder on the way down, so keep
+	 * passing its stderr (and the log ring) through while we wait. If
+	 * nobody reads the pipe, it can block in its signal handler, and we'd
+	 * wait here forever.
+	 */
 	do {
-		w = waitpid(agent_pid, &rv, 0);
-	} while (w == -1 && errno == EINTR);
+		bunyan_ring_drain(STDERR_FILENO);
+		if (sup_logfd != -1) {
+			pfd.fd = sup_logfd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, 100) > 0)
+				(void) pass_agent_stderr(sup_logfd,
+				    sup_logbuf, &err);
+		} else {
+			(void) poll(NULL, 0, 100);
+		}
+		w = waitpid(agent_pid, &rv, WNOHANG);
+	} while (w == 0 || (w == -1 && errno == EINTR));
 
-	bunyan_log(INFO, "agent child stopped",
-	    "exit_status", BNY_INT, WEXITSTATUS(rv),
-	    NULL);
-	assert(WIFEXITED(rv));
+	/* And whatever was still in the pipe when it went. */
+	if (sup_logfd != -1) {
+		while (pass_agent_stderr(sup_logfd, sup_logbuf, &err) > 0)
+			;
+	}
+	bunyan_ring_drain(STDERR_FILENO);
 
+	if (w == agent_pid && WIFSIGNALED(rv)) {
+		bunyan_log(INFO, "agent child stopped",
+		    "signal", BNY_INT, WTERMSIG(rv), NULL);
+	} else {
+		bunyan_log(INFO, "agent child stopped",
+		    "exit_status", BNY_INT, WEXITSTATUS(rv), NULL);
+	}
+
+	bunyan_flush();
 	abort();
 }
 
+/*
+ * Bumps token_cert_gen, on either side of rewriting a slot's cert or chain
+ * pages. It's odd while the pages are being written, so the agent knows that
+ * anything it reads in the meantime may be torn.
+ */
+static void
+bump_cert_gen(void)
+{
+	membar_producer();
+	atomic_inc_32(token_cert_gen);
+	membar_producer();
+}
+
+/*
+ * Finds the slot the agent is referring to in a command. The agent should never
+ * send us a slot ID we didn't give it, so this panics if it's not found.
+ */
+static struct token_slot *
+find_slot(uint8_t id)
+{
+	struct token_slot *ts;
+
+	for (ts = token_slots; ts != NULL; ts = ts->ts_next) {
+		if (ts->ts_id == id)
+			return (ts);
+	}
+	bunyan_log(ERROR, "child sent cmd for invalid key",
+	    "key_id", BNY_INT, id, NULL);
+	supervisor_panic();
+	return (NULL);
+}
+
 static void
 supervisor_loop(zoneid_t zid, nvlist_t *zinfo, int ctlfd, int kidfd, int logfd,
     int listensock)
@@ -1372,22 +1588,33 @@ supervisor_loop(zoneid_t zid, nvlist_t *zinfo, int ctlfd, int kidfd, int logfd,
 	timespec_t to;
 	int rv;
 	struct ctl_cmd cmd, rcmd;
+	struct ctl_req reqs[MAX_CMD_BATCH];
+	struct unlock_req ureqs[MAX_CMD_BATCH];
+	size_t nreqs, nureqs, i;
+	boolean_t replied;
 	enum ctl_cmd_type cmdtype;
 	struct token_slot *ts;
+	struct bunyan_timers *tms;
 	pid_t w;
-	FILE *logf;
-	char *logline;
+	char *logbuf;
+	ssize_t n;
+	int err;
 
+	/*
+	 * The agent's log lines arrive on the shared log ring (see
+	 * bunyan_ring_drain()), so we wake up every so often to drain it even
+	 * if nothing else happens.
+	 */
 	bzero(&to, sizeof (to));
+	to.tv_sec = 1;
 
 	portfd = port_create();
 	assert(portfd > 0);
 
-	logf = fdopen(logfd, "r");
-	VERIFY(logf != NULL);
-
-	logline = calloc(1, MAX_LOG_LINE);
-	VERIFY(logline != NULL);
+	logbuf = calloc(1, MAX_LOG_LINE);
+	VERIFY(logbuf != NULL);
+	sup_logbuf = logbuf;
+	sup_logfd = logfd;
 
 	VERIFY0(port_associate(portfd,
 	    PORT_SOURCE_FD, ctlfd, POLLIN, NULL));
@@ -1397,8 +1624,11 @@ supervisor_loop(zoneid_t zid, nvlist_t *zinfo, int ctlfd, int kidfd, int logfd,
 	    PORT_SOURCE_FD, logfd, POLLIN, NULL));
 
 	while (1) {
-		rv = port_get(portfd, &ev, NULL);
-		if (rv == -1 && errno == EINTR) {
+		bunyan_ring_drain(STDERR_FILENO);
+		bunyan_hist_tick();
+
+		rv = port_get(portfd, &ev, &to);
+		if (rv == -1 && (errno == EINTR || errno == ETIME)) {
 			continue;
 		} else {
 			VERIFY0(rv);
@@ -1436,89 +1666,131 @@ supervisor_loop(zoneid_t zid, nvlist_t *zinfo, int ctlfd, int kidfd, int logfd,
 			    PORT_SOURCE_FD, ctlfd, POLLIN, NULL));
 
 		} else if (ev.portev_object == kidfd) {
-			if (read_cmd(kidfd, &cmd) != 0) {
-				supervisor_panic();
-			}
-			cmdtype = cmd.cc_type;
-			switch (cmdtype) {
-			case CMD_UNLOCK_KEY:
-			case CMD_LOCK_KEY:
-				for (ts = token_slots; ts != NULL;
-				    ts = ts->ts_next) {
-					if (ts->ts_id == cmd.cc_p1)
-						break;
-				}
-				if (ts == NULL) {
+			/*
+			 * The agent only ever sends us doorbells: the actual
+			 * requests are on the submission ring. One doorbell
+			 * can cover many requests, and we may find requests
+			 * whose doorbell we haven't read yet, so just eat all
+			 * the doorbells that are waiting and then drain the
+			 * ring.
+			 */
+			do {
+				if (read_cmd(kidfd, &cmd) != 0 ||
+				    cmd.cc_type != CMD_RING) {
 					bunyan_log(ERROR,
-					    "child sent cmd for invalid key",
-					    "key_id", BNY_INT, cmd.cc_p1,
-					    NULL);
+					    "child sent unknown cmd type",
+					    "type", BNY_INT, cmd.cc_type, NULL);
 					supervisor_panic();
 				}
-
-				if (cmdtype == CMD_UNLOCK_KEY)
-					rv = unlock_key(ts);
-				else
-					rv = lock_key(ts);
-				if (rv == 0) {
-					bzero(&rcmd, sizeof (rcmd));
-					rcmd.cc_cookie = cmd.cc_cookie;
-					rcmd.cc_type = CMD_STATUS;
-					rcmd.cc_p1 = STATUS_OK;
-					VERIFY0(write_cmd(kidfd,
-					    &rcmd));
-					break;
+			} while (kid_cmd_pending(kidfd));
+
+			/*
+			 * The agent often asks for several keys at once (e.g.
+			 * at startup, or after a burst of requests). Take
+			 * them off the ring in batches so that we can unlock
+			 * them all within one card transaction.
+			 */
+			nreqs = 0;
+			while (nreqs < MAX_CMD_BATCH && ctl_ring_get(
+			    &token_ctl_rings->cr_sq, &reqs[nreqs]) == 0) {
+				++nreqs;
+			}
+			while (nreqs > 0) {
+				nureqs = 0;
+				for (i = 0; i < nreqs; ++i) {
+					if (reqs[i].cr_type != CMD_UNLOCK_KEY)
+						continue;
+					bzero(&ureqs[nureqs],
+					    sizeof (ureqs[nureqs]));
+					ureqs[nureqs].ur_slot =
+					    find_slot(reqs[i].cr_slot);
+					ureqs[nureqs].ur_id = reqs[i].cr_id;
+					++nureqs;
 				}
-				break;
-			case CMD_RENEW_CERT:
-				for (ts = token_slots; ts != NULL;
-				    ts = ts->ts_next) {
-					if (ts->ts_id == cmd.cc_p1)
+				if (nureqs > 0)
+					unlock_keys(ureqs, nureqs, kidfd);
+
+				replied = B_FALSE;
+				for (i = 0; i < nreqs; ++i) {
+					cmdtype = reqs[i].cr_type;
+					switch (cmdtype) {
+					case CMD_UNLOCK_KEY:
+						/* Already handled above. */
 						break;
+					case CMD_LOCK_KEY:
+						ts = find_slot(reqs[i].cr_slot);
+						rv = lock_key(ts);
+						if (rv == 0) {
+							post_reply(&reqs[i],
+							    STATUS_OK);
+							replied = B_TRUE;
+						}
+						break;
+					case CMD_RENEW_CERT:
+						ts = find_slot(reqs[i].cr_slot);
+						tms = bny_timers_new();
+						VERIFY3P(tms, !=, NULL);
+						VERIFY0(bny_timer_begin(tms));
+						SOFTTOKEN_CERT_RENEW_START(
+						    (char *)ts->ts_name);
+						bump_cert_gen();
+						if (zid == GLOBAL_ZONEID) {
+							rv = new_cert_global(
+							    ts);
+						} else {
+							rv = new_cert_zone(zid,
+							    zinfo, ts);
+						}
+						bump_cert_gen();
+						SOFTTOKEN_CERT_RENEW_DONE(
+						    (char *)ts->ts_name, rv);
+						VERIFY0(bny_timer_next(tms,
+						    "new_cert"));
+						bny_timers_record(tms, "renew");
+						bny_timers_free(tms);
+						post_reply(&reqs[i], (rv == 0) ?
+						    STATUS_OK : STATUS_ERROR);
+						replied = B_TRUE;
+						break;
+					default:
+						bunyan_log(ERROR,
+						    "child sent unknown "
+						    "request type",
+						    "type", BNY_INT, cmdtype,
+						    NULL);
+						supervisor_panic();
+					}
 				}
-				if (ts == NULL) {
-					bunyan_log(ERROR,
-					    "child sent cmd for invalid key",
-					    "key_id", BNY_INT, cmd.cc_p1,
-					    NULL);
-					supervisor_panic();
-				}
-				if (zid == GLOBAL_ZONEID) {
-					rv = new_cert_global(ts);
-				} else {
-					rv = new_cert_zone(zid, zinfo, ts);
-				}
-				if (rv == 0) {
-					bzero(&rcmd, sizeof (rcmd));
-					rcmd.cc_cookie = cmd.cc_cookie;
-					rcmd.cc_type = CMD_STATUS;
-					rcmd.cc_p1 = STATUS_OK;
-					VERIFY0(write_cmd(kidfd,
-					    &rcmd));
-					break;
+				if (replied)
+					VERIFY0(ring_doorbell(kidfd));
+
+				nreqs = 0;
+				while (nreqs < MAX_CMD_BATCH && ctl_ring_get(
+				    &token_ctl_rings->cr_sq,
+				    &reqs[nreqs]) == 0) {
+					++nreqs;
 				}
-				bzero(&rcmd, sizeof (rcmd));
-				rcmd.cc_cookie = cmd.cc_cookie;
-				rcmd.cc_type = CMD_STATUS;
-				rcmd.cc_p1 = STATUS_ERROR;
-				VERIFY0(write_cmd(kidfd, &rcmd));
-				break;
-			default:
-				bunyan_log(ERROR,
-				    "child sent unknown cmd type",
-				    "type", BNY_INT, cmdtype, NULL);
-				supervisor_panic();
 			}
 			VERIFY0(port_associate(portfd,
 			    PORT_SOURCE_FD, kidfd, POLLIN, NULL));
 
 		} else if (ev.portev_object == logfd) {
-			fgets(logline, MAX_LOG_LINE, logf);
-			mutex_enter(bunyan_wrmutex);
-			fputs(logline, stderr);
-			mutex_exit(bunyan_wrmutex);
-			VERIFY0(port_associate(portfd,
-			    PORT_SOURCE_FD, logfd, POLLIN, NULL));
+			/* The agent's stderr: the ring's drained at the top. */
+			n = pass_agent_stderr(logfd, logbuf, &err);
+			/*
+			 * Keep listening unless we got EOF (the agent's gone)
+			 * or a real error, which would only happen again if
+			 * we went round for more.
+			 */
+			if (n == -1 && err != EAGAIN) {
+				bunyan_log(WARN, "error reading agent stderr, "
+				    "no longer passing it through",
+				    "errno", BNY_INT, err, NULL);
+			}
+			if (n > 0 || (n == -1 && err == EAGAIN)) {
+				VERIFY0(port_associate(portfd,
+				    PORT_SOURCE_FD, logfd, POLLIN, NULL));
+			}
 
 		} else {
 			assert(0);
@@ -1582,20 +1854,26 @@ unshare_code(void)
 	free(mi.dlm_maps);
 }
 
+/*
+ * If the manager has already made and bound our listen socket (because it's
+ * waiting for the first connection to start us, see softtoken_mgr.c), it
+ * hands it to us as listensock, otherwise that's -1 and we make our own.
+ * Likewise zinfo is our zone's entry from the manager's "vmadm lookup", or
+ * NULL if we have to run "vmadm get" ourselves.
+ */
 void
-supervisor_main(zoneid_t zid, int ctlfd)
+supervisor_main(zoneid_t zid, int ctlfd, int listensock, nvlist_t *zinfo)
 {
 	char zonename[ZONENAME_MAX];
 	char sockdir[PATH_MAX];
 	struct sockaddr_un addr;
-	int listensock;
+	struct ctl_cmd cmd;
 	ssize_t len;
 	pid_t kid, w;
 	int kidpipe[2], logpipe[2], vmpipe[2];
 	priv_set_t *pset;
 	int rv, stat;
 	int32_t v;
-	nvlist_t *zinfo = NULL;
 	char *zinfbuf;
 	size_t zinflen;
 	FILE *vmpipef;
@@ -1603,6 +1881,7 @@ supervisor_main(zoneid_t zid, int ctlfd)
 	const char *uuid;
 
 	bunyan_set_name("supervisor");
+	fr_set_name("supervisor");
 
 	unshare_code();
 
@@ -1610,10 +1889,9 @@ supervisor_main(zoneid_t zid, int ctlfd)
 	VERIFY3U(len, >, 0);
 	zonename[len] = '\0';
 
-	VERIFY0(pipe(vmpipe));
-
-	if (zid != GLOBAL_ZONEID) {
+	if (zid != GLOBAL_ZONEID && zinfo == NULL) {
 		/* Go fetch info about the zone from vmadm. */
+		VERIFY0(pipe(vmpipe));
 		kid = forkx(FORK_WAITPID | FORK_NOSIGCHLD);
 		VERIFY(kid != -1);
 		if (kid == 0) {
@@ -1656,7 +1934,10 @@ supervisor_main(zoneid_t zid, int ctlfd)
 			VERIFY(0);
 		}
 		VERIFY(zinfo != NULL);
+		free(zinfbuf);
+	}
 
+	if (zinfo != NULL) {
 		VERIFY0(nvlist_lookup_int32(zinfo, "v", &v));
 		VERIFY3S(v, ==, 1);
 		VERIFY0(nvlist_lookup_string(zinfo, "uuid", (char **)&uuid));
@@ -1704,18 +1985,23 @@ supervisor_main(zoneid_t zid, int ctlfd)
 	 */
 	VERIFY0(mlockall(MCL_CURRENT | MCL_FUTURE));
 
-	/* Open the socket directory and make our listen socket. */
-	snprintf(sockdir, sizeof (sockdir), TOKEN_SOCKET_DIR, zonename);
-	(void) mkdir(sockdir, 0700);
-
-	listensock = socket(AF_UNIX, SOCK_STREAM, 0);
-	assert(listensock > 0);
 	bzero(&addr, sizeof (addr));
 	addr.sun_family = AF_UNIX;
 	snprintf(addr.sun_path, sizeof (addr.sun_path) - 1,
 	    TOKEN_SOCKET_PATH, zonename);
-	(void) unlink(addr.sun_path);
-	VERIFY0(bind(listensock, (struct sockaddr *)&addr, sizeof (addr)));
+
+	/* Open the socket directory and make our listen socket. */
+	if (listensock == -1) {
+		snprintf(sockdir, sizeof (sockdir), TOKEN_SOCKET_DIR,
+		    zonename);
+		(void) mkdir(sockdir, 0700);
+
+		listensock = socket(AF_UNIX, SOCK_STREAM, 0);
+		assert(listensock > 0);
+		(void) unlink(addr.sun_path);
+		VERIFY0(bind(listensock, (struct sockaddr *)&addr,
+		    sizeof (addr)));
+	}
 
 	bunyan_set("zoneid", BNY_INT, zid,
 	    "zonename", BNY_STRING, zonename, NULL);
@@ -1726,8 +2012,22 @@ supervisor_main(zoneid_t zid, int ctlfd)
 	/* Now open up our key files and establish the shared pages. */
 	make_slots(zonename);
 
+	token_cert_gen = mmap(0, getpagesize(), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANON, -1, 0);
+	VERIFY(token_cert_gen != MAP_FAILED);
+	*token_cert_gen = 0;
+
+	/* Also the control rings, see struct ctl_rings. */
+	VERIFY3U(sizeof (struct ctl_rings), <=, getpagesize());
+	VERIFY3U(slot_n * 2, <=, CTL_RING_SIZE);
+	token_ctl_rings = mmap(0, getpagesize(), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANON, -1, 0);
+	VERIFY(token_ctl_rings != MAP_FAILED);
+	bzero(token_ctl_rings, sizeof (struct ctl_rings));
+
 	VERIFY0(pipe(kidpipe));
 	VERIFY0(pipe(logpipe));
+	bunyan_ring_create();
 
 	/* And create the actual agent process. */
 	agent_pid = forkx(FORK_WAITPID | FORK_NOSIGCHLD);
@@ -1740,6 +2040,7 @@ supervisor_main(zoneid_t zid, int ctlfd)
 		VERIFY3S(dup2(logpipe[1], 1), ==, 1);
 		VERIFY3S(dup2(logpipe[1], 2), ==, 2);
 		bunyan_unshare();
+		bunyan_ring_produce(2);
 
 		agent_main(zid, zinfo, listensock, kidpipe[1]);
 		bunyan_log(ERROR, "agent_main returned", NULL);
@@ -1771,5 +2072,13 @@ supervisor_main(zoneid_t zid, int ctlfd)
 	VERIFY(sup_tks != NULL);
 	VERIFY0(piv_system_token_find(sup_tks, &sup_systk));
 
+	/*
+	 * Let the manager know we're up, so it can count us as started and
+	 * get on with starting the next zone.
+	 */
+	bzero(&cmd, sizeof (cmd));
+	cmd.cc_type = CMD_STARTED;
+	VERIFY0(write_cmd(ctlfd, &cmd));
+
 	supervisor_loop(zid, zinfo, ctlfd, kidpipe[0], logpipe[0], listensock);
 }